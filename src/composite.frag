@@ -0,0 +1,13 @@
+#version 450 core
+
+layout (location = 0) in vec2 inUV;
+
+// Premultiplied RGBA text rendered by overlay.frag
+layout (binding = 0) uniform sampler2D s_cache;
+
+layout (location = 0) out vec4 outFragColor;
+
+void main(void)
+{
+	outFragColor = texture(s_cache, inUV);
+}
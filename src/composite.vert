@@ -0,0 +1,22 @@
+#version 450 core
+
+// Where the cached text goes on screen and which part of the cache it is
+layout (push_constant) uniform Rect {
+	vec4 pos;	// x0, y0, x1, y1 in NDC
+	vec4 uv;	// s0, t0, s1, t1
+};
+
+layout (location = 0) out vec2 outUV;
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+void main(void)
+{
+	// Triangle strip corners: (0,0) (1,0) (0,1) (1,1)
+	vec2 corner = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1);
+	gl_Position = vec4(mix(pos.xy, pos.zw, corner), 0.0, 1.0);
+	outUV = mix(uv.xy, uv.zw, corner);
+}
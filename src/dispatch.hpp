@@ -1,5 +1,5 @@
 #pragma once
-#include <map>
+#include <memory>
 #include <vector>
 #include <thread>
 #include <mutex>
@@ -7,6 +7,8 @@
 #include <sys/un.h>
 #include <unistd.h>
 #include "stats.hpp"
+#include "rcu_map.hpp"
+#include "host_allocator.hpp"
 
 // generated from vk.xml
 //#include "vk_dispatch_table_helper.h"
@@ -24,21 +26,6 @@ struct InstanceData {
 	VkInstance instance;
 	PFN_vkSetInstanceLoaderData set_instance_loader_data;
 	std::vector<VkExtensionProperties> exts;
-	CPUStats cpuStats;
-
-	struct {
-		bool quit = false;
-		std::thread thread;
-	} cpu;
-
-	struct {
-		int fd = -1;
-		struct sockaddr_un addr;
-		bool quit = false;
-		std::thread thread;
-		std::vector<std::string> lines;
-		std::mutex mutex;
-	} ss;
 
 	bool extensionSupported(const char* extensionName)
 	{
@@ -51,18 +38,61 @@ struct InstanceData {
 	}
 };
 
+// One reading of a device's sensors, -1 if unknown. Never modified once published
+struct GPUReadings {
+	int core_clock = -1, core_temp = -1, fan_speed = -1;
+	int mem_clock = -1, mem_temp = -1;
+	int busy = -1;
+};
+
+/* Owned by the device and, while it reads them, by the sampler. The sysfs
+ * reads run without global_lock, the device may be destroyed meanwhile.
+ */
+struct GPUSensors {
+	std::unique_ptr<IGPUStats> stats;
+	// Latest reading, std::atomic_load/atomic_store only
+	std::shared_ptr<const GPUReadings> readings;
+};
+
 struct QueueData;
+class OverlayShared;
 struct DeviceData {
 	InstanceData *instance = nullptr;
 
 	PFN_vkSetDeviceLoaderData set_device_loader_data;
 
-	IGPUStats *deviceStats = nullptr;
+	// nullptr without NUUDEL_AMDGPU_INDEX
+	std::shared_ptr<GPUSensors> sensors;
 
 	VkLayerDispatchTable vtable;
 	VkPhysicalDevice physical_device;
 	VkDevice device;
 	vks::VulkanDevice *vulkanDevice = nullptr;
+	// Wraps the application's vkCreateDevice callbacks, for the objects the layer creates
+	HostAllocator *allocator = nullptr;
+	// Font atlas, pipelines etc. for all swapchains, created with the first one
+	OverlayShared *overlay = nullptr;
+	std::mutex overlay_lock;
+
+	// Application enabled timeline semaphores (core 1.2 or VK_KHR_timeline_semaphore),
+	// overlay submits are paced with them instead of fences
+	bool timeline_semaphore = false;
+	PFN_vkGetSemaphoreCounterValueKHR GetSemaphoreCounterValue = nullptr;
+	PFN_vkWaitSemaphoresKHR WaitSemaphores = nullptr;
+
+	// Application enabled shaderStorageImageRead/WriteWithoutFormat, needed by
+	// the compute composite (NUUDEL_COMPUTE)
+	bool storage_without_format = false;
+
+	// Application enabled dynamic rendering (core 1.3 or VK_KHR_dynamic_rendering),
+	// the overlay then needs no render passes or framebuffers
+	bool dynamic_rendering = false;
+	PFN_vkCmdBeginRenderingKHR CmdBeginRendering = nullptr;
+	PFN_vkCmdEndRenderingKHR CmdEndRendering = nullptr;
+
+	// Next layer's vkQueueSubmit2 and vkQueueSubmit2KHR, if the device has them
+	PFN_vkQueueSubmit2KHR QueueSubmit2 = nullptr;
+	PFN_vkQueueSubmit2KHR QueueSubmit2KHR = nullptr;
 
 	struct QueueData *graphic_queue = nullptr;
 	std::vector<QueueData*> queues;
@@ -80,7 +110,7 @@ struct QueueData {
 };
 
 // layer book-keeping information, to store dispatch tables by key
-extern std::map<void *, InstanceData> g_instance_dispatch;
-extern std::map<void *, DeviceData> g_device_dispatch;
+extern RCUMap<InstanceData> g_instance_dispatch;
+extern RCUMap<DeviceData> g_device_dispatch;
 InstanceData *GetInstanceData(void *key);
 DeviceData *GetDeviceData(void *key);
@@ -0,0 +1,162 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "event_loop.hpp"
+
+// epoll_event.data of the eventfd, everything else carries its index in `sources`
+#define EVENTLOOP_WAKE UINT32_MAX
+
+static struct timespec to_timespec(std::chrono::nanoseconds ns)
+{
+	auto s = std::chrono::duration_cast<std::chrono::seconds>(ns);
+	return { (time_t)s.count(), (long)(ns - s).count() };
+}
+
+EventLoop::EventLoop()
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return;
+	}
+
+	wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wakefd < 0) {
+		perror("eventfd");
+		return;
+	}
+
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u32 = EVENTLOOP_WAKE;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0)
+		perror("epoll_ctl");
+}
+
+EventLoop::~EventLoop()
+{
+	stop();
+
+	for (auto& source : sources) {
+		if (source.timer)
+			close(source.fd);
+	}
+	if (wakefd > -1)
+		close(wakefd);
+	if (epfd > -1)
+		close(epfd);
+}
+
+bool EventLoop::watch(int fd)
+{
+	if (epfd < 0 || thread.joinable())
+		return false;
+
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u32 = sources.size();
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+	return true;
+}
+
+bool EventLoop::addTimer(std::chrono::milliseconds interval, std::function<void()> job, clock::time_point first)
+{
+	// steady_clock is CLOCK_MONOTONIC, so `first` can be an absolute expiration
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (fd < 0) {
+		perror("timerfd_create");
+		return false;
+	}
+
+	itimerspec spec = {};
+	spec.it_interval = to_timespec(interval);
+	spec.it_value = to_timespec(first.time_since_epoch());
+	// Zero would disarm it
+	if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+		spec.it_value.tv_nsec = 1;
+
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+		perror("timerfd_settime");
+		close(fd);
+		return false;
+	}
+
+	if (!watch(fd)) {
+		close(fd);
+		return false;
+	}
+	sources.push_back({ fd, true, job });
+	return true;
+}
+
+bool EventLoop::addReader(int fd, std::function<void()> job)
+{
+	if (!watch(fd))
+		return false;
+	sources.push_back({ fd, false, job });
+	return true;
+}
+
+void EventLoop::start()
+{
+	if (epfd < 0 || wakefd < 0 || sources.empty() || thread.joinable())
+		return;
+	thread = std::thread(&EventLoop::loop, this);
+}
+
+void EventLoop::stop()
+{
+	if (!thread.joinable())
+		return;
+
+	uint64_t one = 1;
+	if (write(wakefd, &one, sizeof(one)) < 0)
+		perror("eventfd write");
+	thread.join();
+
+	// Consume it so the loop can be started again
+	uint64_t count;
+	if (read(wakefd, &count, sizeof(count)) < 0)
+		count = 0;
+}
+
+void EventLoop::loop()
+{
+	epoll_event events[16];
+
+	while (true) {
+		int n = epoll_wait(epfd, events, 16, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return;
+		}
+
+		bool ran = false;
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.u32 == EVENTLOOP_WAKE)
+				return;
+
+			Source& source = sources[events[i].data.u32];
+			if (source.timer) {
+				// Number of expirations since the last read, more than one means ticks were missed
+				uint64_t expirations;
+				if (read(source.fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+					continue;
+				ran = true;
+			}
+			source.run();
+		}
+
+		if (ran && afterJob)
+			afterJob();
+	}
+}
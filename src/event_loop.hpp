@@ -0,0 +1,50 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+/*
+	The layer's one background thread. Periodic jobs get a timerfd each and
+	file descriptors (the NUUDEL_SOCKET socket) get a callback when they turn
+	readable, all waited on with a single epoll_wait. The thread only wakes
+	up for a deadline or real input, stop() wakes it through an eventfd.
+
+	Sources are added before start() and stay fixed while the thread runs.
+	A timer that falls behind runs once and skips the ticks it missed.
+*/
+class EventLoop
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	EventLoop();
+	~EventLoop();
+
+	// First run at `first`, then every `interval`
+	bool addTimer(std::chrono::milliseconds interval, std::function<void()> job, clock::time_point first = clock::now());
+	// Called whenever `fd` is readable, the callback has to drain it. `fd` stays owned by the caller
+	bool addReader(int fd, std::function<void()> job);
+	// Runs after every wakeup that ran at least one timer
+	void after(std::function<void()> job) { afterJob = job; }
+
+	void start();
+	void stop();
+
+private:
+	struct Source {
+		int fd;
+		bool timer;
+		std::function<void()> run;
+	};
+
+	std::vector<Source> sources;
+	std::function<void()> afterJob;
+
+	int epfd = -1;
+	int wakefd = -1;
+	std::thread thread;
+
+	bool watch(int fd);
+	void loop();
+};
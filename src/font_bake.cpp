@@ -0,0 +1,63 @@
+// Bakes the stb font atlas and glyph metrics into a header at build time,
+// so the layer does not have to unpack them every time a device shows up.
+//
+// Usage: font_bake <output.h>
+
+#include <cstdio>
+#include "../external/stb/stb_font_consolas_bold_24_latin1.inl"
+
+// Same size as the texture the overlay always used, the atlas rows padded to a power of two
+#define FONT_BAKE_WIDTH  STB_FONT_consolas_bold_24_latin1_BITMAP_WIDTH
+#define FONT_BAKE_HEIGHT STB_FONT_consolas_bold_24_latin1_BITMAP_HEIGHT_POW2
+
+static unsigned char pixels[FONT_BAKE_HEIGHT][FONT_BAKE_WIDTH];
+static stb_fontchar chars[STB_FONT_consolas_bold_24_latin1_NUM_CHARS];
+
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <output.h>\n", argv[0]);
+		return 1;
+	}
+
+	FILE *out = fopen(argv[1], "w");
+	if (!out) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	stb_font_consolas_bold_24_latin1(chars, pixels, FONT_BAKE_HEIGHT);
+
+	fprintf(out, "// Generated by font_bake from stb_font_consolas_bold_24_latin1.inl, do not edit\n");
+	fprintf(out, "#pragma once\n#include <cstdint>\n\n");
+
+	// Same layout and guard as the .inl, so the layer does not need it at all
+	fprintf(out, "#ifndef STB_FONTCHAR__TYPEDEF\n#define STB_FONTCHAR__TYPEDEF\n");
+	fprintf(out, "typedef struct\n{\n");
+	fprintf(out, "\tfloat s0,t0,s1,t1;\n\tsigned short x0,y0,x1,y1;\n\tint   advance_int;\n");
+	fprintf(out, "\tfloat s0f,t0f,s1f,t1f;\n\tfloat x0f,y0f,x1f,y1f;\n\tfloat advance;\n");
+	fprintf(out, "} stb_fontchar;\n#endif\n\n");
+
+	fprintf(out, "static constexpr uint32_t font_atlas_width = %d;\n", FONT_BAKE_WIDTH);
+	fprintf(out, "static constexpr uint32_t font_atlas_height = %d;\n", FONT_BAKE_HEIGHT);
+	fprintf(out, "static constexpr uint32_t font_atlas_first_char = %d;\n", STB_FONT_consolas_bold_24_latin1_FIRST_CHAR);
+	fprintf(out, "static constexpr uint32_t font_atlas_num_chars = %d;\n\n", STB_FONT_consolas_bold_24_latin1_NUM_CHARS);
+
+	fprintf(out, "static constexpr uint8_t font_atlas_pixels[%d] = {", FONT_BAKE_WIDTH * FONT_BAKE_HEIGHT);
+	const unsigned char *flat = &pixels[0][0];
+	for (int i = 0; i < FONT_BAKE_WIDTH * FONT_BAKE_HEIGHT; i++)
+		fprintf(out, "%s%d,", i % 32 ? "" : "\n\t", flat[i]);
+	fprintf(out, "\n};\n\n");
+
+	// Hex float literals keep the texture coordinates bit exact
+	fprintf(out, "static constexpr stb_fontchar font_atlas_chars[%d] = {\n", STB_FONT_consolas_bold_24_latin1_NUM_CHARS);
+	for (const stb_fontchar& c : chars) {
+		fprintf(out, "\t{ %af, %af, %af, %af, %d, %d, %d, %d, %d, ",
+			c.s0, c.t0, c.s1, c.t1, c.x0, c.y0, c.x1, c.y1, c.advance_int);
+		fprintf(out, "%af, %af, %af, %af, %af, %af, %af, %af, %af },\n",
+			c.s0f, c.t0f, c.s1f, c.t1f, c.x0f, c.y0f, c.x1f, c.y1f, c.advance);
+	}
+	fprintf(out, "};\n");
+
+	return fclose(out) ? 1 : 0;
+}
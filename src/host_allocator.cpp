@@ -0,0 +1,116 @@
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include "host_allocator.hpp"
+
+// In front of every allocation, `offset` leads back to what was really allocated
+struct AllocationHeader {
+	size_t size;
+	size_t offset;
+};
+
+static std::atomic<uint64_t> live_allocations { 0 };
+static std::atomic<uint64_t> live_bytes { 0 };
+static std::atomic<uint64_t> total_allocations { 0 };
+
+HostAllocator::HostAllocator(const VkAllocationCallbacks *application)
+{
+	app = application ? *application : VkAllocationCallbacks {};
+
+	callbacks = {};
+	callbacks.pUserData = this;
+	callbacks.pfnAllocation = Allocation;
+	callbacks.pfnReallocation = Reallocation;
+	callbacks.pfnFree = Free;
+	callbacks.pfnInternalAllocation = InternalAllocation;
+	callbacks.pfnInternalFree = InternalFree;
+}
+
+void *HostAllocator::allocate(size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+	alignment = std::max(alignment, alignof(AllocationHeader));
+	size_t offset = (sizeof(AllocationHeader) + alignment - 1) / alignment * alignment;
+
+	void *base = nullptr;
+	if (app.pfnAllocation)
+		base = app.pfnAllocation(app.pUserData, offset + size, alignment, scope);
+	else if (posix_memalign(&base, std::max(alignment, sizeof(void *)), offset + size))
+		base = nullptr;
+	if (!base)
+		return nullptr;
+
+	uint8_t *memory = (uint8_t *)base + offset;
+	AllocationHeader *header = (AllocationHeader *)memory - 1;
+	header->size = size;
+	header->offset = offset;
+
+	live_allocations++;
+	live_bytes += size;
+	total_allocations++;
+	return memory;
+}
+
+void HostAllocator::release(void *memory)
+{
+	if (!memory)
+		return;
+
+	AllocationHeader *header = (AllocationHeader *)memory - 1;
+	live_allocations--;
+	live_bytes -= header->size;
+
+	void *base = (uint8_t *)memory - header->offset;
+	if (app.pfnFree)
+		app.pfnFree(app.pUserData, base);
+	else
+		free(base);
+}
+
+VKAPI_ATTR void* VKAPI_CALL HostAllocator::Allocation(void *user, size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+	return ((HostAllocator *)user)->allocate(size, alignment, scope);
+}
+
+VKAPI_ATTR void* VKAPI_CALL HostAllocator::Reallocation(void *user, void *original, size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+	HostAllocator *allocator = (HostAllocator *)user;
+	if (!original)
+		return allocator->allocate(size, alignment, scope);
+	if (!size) {
+		allocator->release(original);
+		return nullptr;
+	}
+
+	// On failure the original has to stay untouched
+	void *memory = allocator->allocate(size, alignment, scope);
+	if (!memory)
+		return nullptr;
+	memcpy(memory, original, std::min(size, ((AllocationHeader *)original - 1)->size));
+	allocator->release(original);
+	return memory;
+}
+
+VKAPI_ATTR void VKAPI_CALL HostAllocator::Free(void *user, void *memory)
+{
+	((HostAllocator *)user)->release(memory);
+}
+
+VKAPI_ATTR void VKAPI_CALL HostAllocator::InternalAllocation(void *user, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope)
+{
+	HostAllocator *allocator = (HostAllocator *)user;
+	if (allocator->app.pfnInternalAllocation)
+		allocator->app.pfnInternalAllocation(allocator->app.pUserData, size, type, scope);
+}
+
+VKAPI_ATTR void VKAPI_CALL HostAllocator::InternalFree(void *user, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope)
+{
+	HostAllocator *allocator = (HostAllocator *)user;
+	if (allocator->app.pfnInternalFree)
+		allocator->app.pfnInternalFree(allocator->app.pUserData, size, type, scope);
+}
+
+HostAllocationStats HostAllocator::stats()
+{
+	return { live_allocations.load(), live_bytes.load(), total_allocations.load() };
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include "vulkan/vulkan.h"
+
+// Host memory held by the layer's Vulkan objects, over all devices and swapchains
+struct HostAllocationStats {
+	uint64_t allocations;  // live allocations
+	uint64_t bytes;        // live bytes, without the bookkeeping headers
+	uint64_t total;        // allocations made so far, reallocations included
+};
+
+/*
+	VkAllocationCallbacks handed to every object the layer creates. Forwards to
+	the callbacks the application gave vkCreateDevice or vkCreateSwapchainKHR,
+	or to the C library without them, and counts what passes through.
+
+	Every allocation carries a header with its size in front of it, so frees
+	are counted in bytes and a reallocation can copy the old contents while
+	keeping the alignment, which plain realloc() can not.
+
+	Drivers hold on to pUserData, so it has to outlive every object that was
+	created with it.
+*/
+class HostAllocator
+{
+	VkAllocationCallbacks callbacks;
+	// pfnAllocation is null if the application gave none
+	VkAllocationCallbacks app;
+
+	void *allocate(size_t size, size_t alignment, VkSystemAllocationScope scope);
+	void release(void *memory);
+
+	static VKAPI_ATTR void* VKAPI_CALL Allocation(void *user, size_t size, size_t alignment, VkSystemAllocationScope scope);
+	static VKAPI_ATTR void* VKAPI_CALL Reallocation(void *user, void *original, size_t size, size_t alignment, VkSystemAllocationScope scope);
+	static VKAPI_ATTR void VKAPI_CALL Free(void *user, void *memory);
+	static VKAPI_ATTR void VKAPI_CALL InternalAllocation(void *user, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope);
+	static VKAPI_ATTR void VKAPI_CALL InternalFree(void *user, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope);
+
+public:
+	explicit HostAllocator(const VkAllocationCallbacks *application);
+
+	// What to pass as pAllocator
+	const VkAllocationCallbacks *get() const { return &callbacks; }
+	// The application's callbacks, or nullptr
+	const VkAllocationCallbacks *application() const { return app.pfnAllocation ? &app : nullptr; }
+
+	static HostAllocationStats stats();
+};
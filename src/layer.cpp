@@ -6,13 +6,18 @@
 #include <string.h>
 #include <cstdlib>
 
+#include <atomic>
 #include <chrono>
 #include <ctime>
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
+#include <memory>
 #include "dispatch.hpp"
+#include "event_loop.hpp"
+#include "layer_procs.hpp"
 #include "overlay.hpp"
+#include "perfect_hash.hpp"
 
 //#include "vks/VulkanTools.h"
 
@@ -84,64 +89,123 @@ void *GetKey(DispatchableType inst)
 }*/
 
 // layer book-keeping information, to store dispatch tables by key
-std::map<void *, InstanceData> g_instance_dispatch;
-std::map<void *, DeviceData> g_device_dispatch;
-std::map<void *, QueueData> g_queue_data;
+// Lookups are lock-free so the present path never waits on global_lock
+RCUMap<InstanceData> g_instance_dispatch;
+RCUMap<DeviceData> g_device_dispatch;
+RCUMap<QueueData> g_queue_data;
 
 static float overlay_x = 25.0f, overlay_y = 25.0f;
 static bool avg_cpus = false;
+// NUUDEL_INJECT_SUBMIT, draw the overlay in the application's last submit before present
+static bool inject_submit = false;
+// NUUDEL_INTERVALS, how often each collector samples, in milliseconds
+static struct {
+	int cpu = 500, gpu = 500, fps = 500, clock = 1000;
+} stats_intervals;
 
 InstanceData *GetInstanceData(void *key)
 {
-	scoped_lock l(global_lock);
 	return &g_instance_dispatch[GetKey(key)];
 }
 
 DeviceData *GetDeviceData(void *key)
 {
-	scoped_lock l(global_lock);
 	return &g_device_dispatch[GetKey(key)];
 }
 
 QueueData *GetQueueData(void *key)
 {
-	scoped_lock l(global_lock);
 	return &g_queue_data[key];
 }
 
 struct PresentStats
 {
+	// Set on creation, then only touched by the fps timer once the overlay is up
 	hrc::time_point last_fps_update;
-	unsigned n_frames_since_update = 0;
-	float last_fps = 0;
+	// Counted by presents, taken by the fps timer
+	std::atomic<unsigned> n_frames_since_update { 0 };
+	std::atomic<float> last_fps { 0 };
 };
 
-std::map<void*, PresentStats> present_stats;
+/* Overlay submit fence. One submit covers every swapchain of a present,
+ * so the images drawn in it all hold a reference to the same fence.
+ */
+struct SubmitFence {
+	DeviceData *device;
+	VkFence fence = VK_NULL_HANDLE;
+	bool pending = false;
+
+	SubmitFence(DeviceData *device) : device(device)
+	{
+		VkFenceCreateInfo fence_info = {};
+		fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		VK_CHECK_RESULT(device->vtable.CreateFence(device->device, &fence_info, device->allocator->get(), &fence));
+	}
+
+	~SubmitFence()
+	{
+		wait();
+		device->vtable.DestroyFence(device->device, fence, device->allocator->get());
+	}
+
+	void wait()
+	{
+		if (!pending)
+			return;
+		if (device->vtable.GetFenceStatus(device->device, fence) != VK_SUCCESS)
+			VK_CHECK_RESULT(device->vtable.WaitForFences(device->device, 1, &fence, VK_TRUE, UINT64_MAX));
+		pending = false;
+	}
+};
 
 /* Mapped from VkSwapchainKHR */
 struct SwapchainData {
 	DeviceData *device = nullptr;
-	TextOverlay *overlay = nullptr;
+	// Set by setup_thread once everything is ready, presents skip the overlay until then
+	std::atomic<TextOverlay *> overlay { nullptr };
+	// Held by the sampler while it rebuilds the text, never by presents
+	std::mutex text_lock;
+	std::thread setup_thread;
 	PresentStats stats;
 
 	VkSwapchainKHR swapchain;
 	unsigned width, height;
 	VkFormat format;
 
+	// Image views, framebuffers and semaphores are created with it
+	HostAllocator *allocator = nullptr;
+
 	std::vector<VkImage> images;
 	std::vector<VkImageView> image_views;
 	std::vector<VkFramebuffer> framebuffers;
 
-	VkRenderPass render_pass = 0;
+	// Overlay is blended in with compute, no framebuffers
+	bool compute = false;
 
 	std::vector<VkSemaphore> submission_semaphore;
-	std::vector<VkFence> fences;
+	// Without timeline semaphores
+	std::vector<std::shared_ptr<SubmitFence>> fences;
+
+	// With timeline semaphores: one per swapchain, bumped by every overlay
+	// submit, and the value each image's command buffers were submitted with
+	VkSemaphore timeline = VK_NULL_HANDLE;
+	uint64_t timeline_value = 0;
+	std::vector<uint64_t> timeline_values;
+
+	// NUUDEL_INJECT_SUBMIT: images acquired and not presented yet, the
+	// semaphores the application presented with so far, and images whose
+	// overlay already went out with an application submit
+	std::vector<uint32_t> acquired;
+	std::vector<VkSemaphore> present_waits;
+	std::vector<bool> injected;
+	// Acquires, presents and submits may run on different threads and queues.
+	// Guards the inject state above and the timeline values and fences they update
+	std::mutex submit_lock;
 };
 
-std::map<void *, SwapchainData> g_swapchain_data;
+RCUMap<SwapchainData> g_swapchain_data;
 SwapchainData *GetSwapchainData(void *key)
 {
-	scoped_lock l(global_lock);
 	return &g_swapchain_data[key];
 }
 
@@ -171,6 +235,56 @@ void readExtensions(VkPhysicalDevice device)
 	assert(!vkRes);
 }
 
+// Timeline semaphores are only usable if the application turned them on
+static bool TimelineSemaphoreEnabled(const VkDeviceCreateInfo *pCreateInfo)
+{
+	vk_foreach_struct_const(item, pCreateInfo->pNext) {
+		switch (item->sType) {
+		case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES:
+			if (((const VkPhysicalDeviceTimelineSemaphoreFeatures *)item)->timelineSemaphore)
+				return true;
+			break;
+		case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES:
+			if (((const VkPhysicalDeviceVulkan12Features *)item)->timelineSemaphore)
+				return true;
+			break;
+		default:
+			break;
+		}
+	}
+	return false;
+}
+
+static bool DynamicRenderingEnabled(const VkDeviceCreateInfo *pCreateInfo)
+{
+	vk_foreach_struct_const(item, pCreateInfo->pNext) {
+		switch (item->sType) {
+		case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES:
+			if (((const VkPhysicalDeviceDynamicRenderingFeatures *)item)->dynamicRendering)
+				return true;
+			break;
+		case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES:
+			if (((const VkPhysicalDeviceVulkan13Features *)item)->dynamicRendering)
+				return true;
+			break;
+		default:
+			break;
+		}
+	}
+	return false;
+}
+
+// Compute composite accesses the swapchain image without a format qualifier
+static bool StorageWithoutFormatEnabled(const VkDeviceCreateInfo *pCreateInfo)
+{
+	const VkPhysicalDeviceFeatures *features = pCreateInfo->pEnabledFeatures;
+	vk_foreach_struct_const(item, pCreateInfo->pNext) {
+		if (item->sType == VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2)
+			features = &((const VkPhysicalDeviceFeatures2 *)item)->features;
+	}
+	return features && features->shaderStorageImageReadWithoutFormat && features->shaderStorageImageWriteWithoutFormat;
+}
+
 static QueueData *new_queue_data(VkQueue queue,
 							 const VkQueueFamilyProperties *family_props,
 							 uint32_t family_index,
@@ -239,113 +353,99 @@ static float AddStatText(TextOverlay *textOverlay, const std::string& line, floa
 	return 0.f;
 }
 
+/* What the sampler collected on one tick. Never modified once published,
+ * every overlay in the process builds its text from the same one.
+ */
+struct StatsSnapshot
+{
+	std::string time;
+	std::vector<double> cpu_percent;
+	double cpu_average = 0;
+	// Received through NUUDEL_SOCKET
+	std::vector<std::string> lines;
+};
+
 // Update the text buffer displayed by the text overlay
-static void updateTextOverlay(const SwapchainData * const swapchain)
+static void updateTextOverlay(const SwapchainData * const swapchain, TextOverlay *textOverlay,
+							const StatsSnapshot *snapshot)
 {
 	const DeviceData * const device_data = swapchain->device;
-	InstanceData * instance = device_data->instance;
-	TextOverlay *textOverlay = swapchain->overlay;
 
 	float scaling = 1.0f, scaling_cpu = 1.0f;
 	float tmp_x = overlay_x, tmp_y = overlay_y;
 	std::stringstream ss;
 
-#ifdef NDEBUG
+	// Still being set up
 	if (!textOverlay)
 		return;
-#endif
-
-	textOverlay->beginTextUpdate();
 
-	std::time_t t = std::time(nullptr);
-	std::stringstream time;
-	time << std::put_time(std::localtime(&t), "%T");
+	// GPU still reads the buffers, the next tick gets to update it
+	if (!textOverlay->beginTextUpdate())
+		return;
 
-	tmp_y += AddStatText(textOverlay, time.str(), overlay_x, overlay_y, 1.0f);
+	if (snapshot)
+		tmp_y += AddStatText(textOverlay, snapshot->time, overlay_x, overlay_y, 1.0f);
 
-	ss << "FPS: " << std::fixed << std::setprecision(0) << swapchain->stats.last_fps;
+	ss << "FPS: " << std::fixed << std::setprecision(0) << swapchain->stats.last_fps.load();
 	tmp_y += AddStatText(textOverlay, ss.str(), tmp_x, tmp_y, 1.0f);
 
-	double avg_cpus_percent = 0;
-	if (instance /*&& instance->stats.Updated()*/) {
-
-		if (device_data->deviceStats) {
-			int value = -1;
-			// Core
-			{
-				value = device_data->deviceStats->getCoreClock();
-				ss.str(""); ss.clear();
-				ss << "Core: ";
-				if (value > -1)
-					ss << value << " MHz ";
-				value = device_data->deviceStats->getCoreTemp();
-				if (value > -1)
-					ss << value << "°C ";
-				value = device_data->deviceStats->getFanSpeed();
-				if (value > -1)
-					ss << value << " RPM ";
-				tmp_y += AddStatText(textOverlay, ss.str(), tmp_x, tmp_y, scaling);
-			}
-			// Mem
-			{
-				ss.str(""); ss.clear();
-				ss << "Mem:  ";
-				value = device_data->deviceStats->getMemClock();
-				if (value > -1)
-					ss << value << " MHz ";
-
-				value = device_data->deviceStats->getMemTemp();
-				if (value > -1)
-					ss << value << "°C ";
+	std::shared_ptr<const GPUReadings> gpu;
+	if (device_data->sensors)
+		gpu = std::atomic_load(&device_data->sensors->readings);
+
+	if (gpu) {
+		int value = -1;
+		// Core
+		{
+			value = gpu->core_clock;
+			ss.str(""); ss.clear();
+			ss << "Core: ";
+			if (value > -1)
+				ss << value << " MHz ";
+			value = gpu->core_temp;
+			if (value > -1)
+				ss << value << "°C ";
+			value = gpu->fan_speed;
+			if (value > -1)
+				ss << value << " RPM ";
+			tmp_y += AddStatText(textOverlay, ss.str(), tmp_x, tmp_y, scaling);
+		}
+		// Mem
+		{
+			ss.str(""); ss.clear();
+			ss << "Mem:  ";
+			value = gpu->mem_clock;
+			if (value > -1)
+				ss << value << " MHz ";
+
+			value = gpu->mem_temp;
+			if (value > -1)
+				ss << value << "°C ";
+			tmp_y += AddStatText(textOverlay, ss.str(), tmp_x, tmp_y, scaling);
+		}
+		// Busy
+		{
+			value = gpu->busy;
+			if (value > -1) {
+				ss.str(""); ss.clear(); ss << "Busy: " << value << "% ";
 				tmp_y += AddStatText(textOverlay, ss.str(), tmp_x, tmp_y, scaling);
 			}
-			// Busy
-			{
-				value = device_data->deviceStats->getGPUUsage();
-				if (value > -1) {
-					ss.str(""); ss.clear(); ss << "Busy: " << value << "% ";
-					tmp_y += AddStatText(textOverlay, ss.str(), tmp_x, tmp_y, scaling);
-				}
-			}
 		}
+	}
 
-		int cpuid = 0;
-		//double period = instance->stats.GetCPUPeriod();
-		//printf("period %f\n", period);
-		for (const CPUData &cpuData : instance->cpuStats.GetCPUData()) {
-
-			double total = (double)(cpuData.totalPeriod == 0 ? 1 : cpuData.totalPeriod);
-			double percent = 0;
-			double v[4];
-			v[0] = cpuData.nicePeriod / total * 100.0;
-			v[1] = cpuData.userPeriod / total * 100.0;
-
-			/* if not detailed */
-			v[2] = cpuData.systemAllPeriod / total * 100.0;
-			v[3] = (cpuData.stealPeriod + cpuData.guestPeriod) / total * 100.0;
-			percent = std::clamp(v[0]+v[1]+v[2]+v[3], 0.0, 100.0);
-			//percent = v[0]+v[1]+v[2]+v[3];
-
-			if (!avg_cpus) {
-				ss.str(""); ss.clear(); ss << "CPU" << cpuid << ": " << std::fixed << std::setprecision(0) << percent << "%";
+	if (snapshot) {
+		if (!avg_cpus) {
+			for (size_t cpuid = 0; cpuid < snapshot->cpu_percent.size(); cpuid++) {
+				ss.str(""); ss.clear(); ss << "CPU" << cpuid << ": " << std::fixed << std::setprecision(0) << snapshot->cpu_percent[cpuid] << "%";
 				tmp_y += AddStatText(textOverlay, ss.str(), tmp_x, tmp_y, scaling_cpu);
-			} else {
-				avg_cpus_percent += percent;
 			}
-			cpuid++;
-		}
-
-		if (avg_cpus) {
-			ss.str(""); ss.clear(); ss << "CPU:  " << std::fixed << std::setprecision(0) << (avg_cpus_percent / cpuid) << "%";
+		} else {
+			ss.str(""); ss.clear(); ss << "CPU:  " << std::fixed << std::setprecision(0) << snapshot->cpu_average << "%";
 			tmp_y += AddStatText(textOverlay, ss.str(), tmp_x, tmp_y, scaling_cpu);
-			cpuid++;
 		}
 
-		{
-			std::lock_guard l(instance->ss.mutex);
-			for (auto& line : instance->ss.lines)
-				tmp_y += AddStatText(textOverlay, line, tmp_x, tmp_y, scaling);
-		}
+		for (auto& line : snapshot->lines)
+			tmp_y += AddStatText(textOverlay, line, tmp_x, tmp_y, scaling);
 		//textOverlay->addText("Some º text 1", 50.0f, 35.0f, TextOverlay::alignLeft);
 		//textOverlay->addText("Some text 2 þñ©öäüÕ", 50.0f, 65.0f, TextOverlay::alignLeft);
 	}
@@ -353,107 +453,189 @@ static void updateTextOverlay(const SwapchainData * const swapchain)
 	textOverlay->endTextUpdate();
 }
 
-static void StatsUpdateThread(void *ptr)
+/* One per process, however many instances and devices there are: launchers
+ * and translation layers like to create several instances, which used to
+ * mean as many threads reading /proc/stat and redrawing the same swapchains.
+ * Reference counted by the instances, see SamplerSubscribe.
+ */
+struct StatsSampler
 {
-	InstanceData *instance = static_cast<InstanceData*>(ptr);
-	if (!instance)
-		return;
-
-	auto now = hrc::now();
-	auto last_update = now;
-
-	while (!instance->cpu.quit) {
-		now = hrc::now();
-		auto dur = std::chrono::duration_cast<ms>(now - last_update).count();
-
-		if (dur >= 500) {
-			last_update = now;
-			instance->cpuStats.UpdateCPUData();
+	CPUStats cpuStats;
+	EventLoop loop;
+
+	// NUUDEL_SOCKET, only touched on the loop's thread
+	struct {
+		int fd = -1;
+		struct sockaddr_un addr;
+		bool doClear = false;
+		std::string line;
+		std::vector<std::string> lines;
+	} ss;
+};
 
-			scoped_lock l(global_lock);
+static std::mutex sampler_lock;
+static StatsSampler *sampler = nullptr;
+static unsigned sampler_refs = 0;
+// Latest tick, std::atomic_load/atomic_store only. Outlives the sampler so readers need no lock
+static std::shared_ptr<const StatsSnapshot> latest_snapshot;
 
-			for (auto& swapchain_data: g_swapchain_data) {
-				PresentStats& ps = swapchain_data.second.stats;
+static std::shared_ptr<const StatsSnapshot> TakeSnapshot(StatsSampler *sampler)
+{
+	auto snapshot = std::make_shared<StatsSnapshot>();
 
-				//printf("FPS: %0.f\n", ps.n_frames_since_update / (dur/1000.f));
-				ps.last_fps = ps.n_frames_since_update / (dur/1000.f);
-				ps.n_frames_since_update = 0;
-				updateTextOverlay(&swapchain_data.second);
-			}
-		} else {
-			std::this_thread::sleep_for(ms(1));
-		}
+	std::time_t t = std::time(nullptr);
+	std::stringstream time;
+	time << std::put_time(std::localtime(&t), "%T");
+	snapshot->time = time.str();
+
+	//double period = sampler->cpuStats.GetCPUPeriod();
+	//printf("period %f\n", period);
+	for (const CPUData &cpuData : sampler->cpuStats.GetCPUData()) {
+
+		double total = (double)(cpuData.totalPeriod == 0 ? 1 : cpuData.totalPeriod);
+		double v[4];
+		v[0] = cpuData.nicePeriod / total * 100.0;
+		v[1] = cpuData.userPeriod / total * 100.0;
+
+		/* if not detailed */
+		v[2] = cpuData.systemAllPeriod / total * 100.0;
+		v[3] = (cpuData.stealPeriod + cpuData.guestPeriod) / total * 100.0;
+		snapshot->cpu_percent.push_back(std::clamp(v[0]+v[1]+v[2]+v[3], 0.0, 100.0));
+		snapshot->cpu_average += snapshot->cpu_percent.back();
 	}
-	#ifndef NDEBUG
-		std::cerr << "Stats updating thread quit" << std::endl;
-	#endif
+	if (snapshot->cpu_percent.size())
+		snapshot->cpu_average /= snapshot->cpu_percent.size();
+
+	snapshot->lines = sampler->ss.lines;
+	return snapshot;
 }
 
-static void SocketThread(void *ptr)
+// Drains the datagrams queued on NUUDEL_SOCKET, runs on the loop's thread
+static void ReadSocket(StatsSampler *sampler)
 {
 	int len = -1;
 	struct sockaddr_un from;
 	socklen_t fromlen = sizeof(from);
 	char buff[8192];
 
-	InstanceData *instance = static_cast<InstanceData*>(ptr);
-	if (!instance)
-		return;
-
-	auto& ss = instance->ss;
-	bool doClear= false;
-	std::stringstream sstr;
-
-	while (!ss.quit) {
+	auto& ss = sampler->ss;
 
-		len = recvfrom(ss.fd, buff, sizeof(buff), 0, (struct sockaddr *)&from, &fromlen);
-		if (len < 0 && errno == EAGAIN)
-			continue;
-		else if (len < 0)
-			break;
+	while ((len = recvfrom(ss.fd, buff, sizeof(buff), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen)) >= 0) {
 
 #ifndef NDEBUG
-		std::cerr << "recvfrom: " << len << " " << buff << std::endl;
+		std::cerr << "recvfrom: " << len << " " << std::string(buff, len) << std::endl;
 #endif
 
-		{
-			std::lock_guard l(ss.mutex);
-			if (doClear || ss.lines.size() > 15) {
-				doClear = false;
-				ss.lines.clear();
-			}
+		if (ss.doClear || ss.lines.size() > 15) {
+			ss.doClear = false;
+			ss.lines.clear();
+		}
 
-			for (int i=0; i< len; i++) {
-				if (buff[i] == '\0') {
-					doClear= true;
-					continue;
-				}
-				if (buff[i] == '\r')
-					continue;
-				if (buff[i] == '\n') {
-					ss.lines.push_back(sstr.str());
-					sstr.str(""); sstr.clear();
-				} else {
-					sstr << buff[i];
-				}
+		for (int i=0; i< len; i++) {
+			if (buff[i] == '\0') {
+				ss.doClear= true;
+				continue;
+			}
+			if (buff[i] == '\r')
+				continue;
+			if (buff[i] == '\n') {
+				ss.lines.push_back(ss.line);
+				ss.line.clear();
+			} else {
+				ss.line += buff[i];
 			}
-
-			memset(buff, 0, sizeof(buff));
 		}
 	}
 
-	if (!ss.quit && len < 0)
-		perror("socket thread");
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("recvfrom");
+}
 
-	if (ss.fd > -1) {
-		close(ss.fd);
+/* Every collector samples on its own timer and the overlays are rebuilt
+ * once after each wakeup. The loop's thread sleeps in epoll_wait until the
+ * next deadline or socket message in between.
+ */
+static void StartStatsLoop(StatsSampler *sampler)
+{
+	EventLoop& stats = sampler->loop;
+
+	stats.addTimer(ms(stats_intervals.cpu), [sampler]() {
+		sampler->cpuStats.UpdateCPUData();
+	});
+
+	// Sensors are sysfs reads, take them here instead of in every text update
+	stats.addTimer(ms(stats_intervals.gpu), []() {
+		// global_lock only while grabbing the sensors, not for the reads
+		std::vector<std::shared_ptr<GPUSensors>> devices;
+		{
+			scoped_lock l(global_lock);
+			g_device_dispatch.for_each([&devices](void *, DeviceData& device_data) {
+				if (device_data.sensors)
+					devices.push_back(device_data.sensors);
+			});
+		}
+
+		for (auto& sensors : devices) {
+			auto readings = std::make_shared<GPUReadings>();
+			readings->core_clock = sensors->stats->getCoreClock();
+			readings->core_temp = sensors->stats->getCoreTemp();
+			readings->fan_speed = sensors->stats->getFanSpeed();
+			readings->mem_clock = sensors->stats->getMemClock();
+			readings->mem_temp = sensors->stats->getMemTemp();
+			readings->busy = sensors->stats->getGPUUsage();
+			std::atomic_store(&sensors->readings, std::shared_ptr<const GPUReadings>(readings));
+		}
+	});
+
+	// The read guard of for_each keeps the swapchains alive, nothing here needs global_lock
+	stats.addTimer(ms(stats_intervals.fps), []() {
+		auto now = hrc::now();
+		g_swapchain_data.for_each([now](void *, SwapchainData& swapchain_data) {
+			// Still being created, last_fps_update may not be set yet
+			if (!swapchain_data.overlay.load())
+				return;
+
+			PresentStats& ps = swapchain_data.stats;
+			auto dur = std::chrono::duration_cast<ms>(now - ps.last_fps_update).count();
+			if (dur <= 0)
+				return;
+
+			unsigned frames = ps.n_frames_since_update.exchange(0);
+			//printf("FPS: %0.f\n", frames / (dur/1000.f));
+			ps.last_fps = frames / (dur/1000.f);
+			ps.last_fps_update = now;
+		});
+	});
+
+	// Nothing to sample, it only has to tick on the second so the time shown is right
+	auto wall = std::chrono::system_clock::now().time_since_epoch();
+	auto to_next_second = sec(1) - (wall - std::chrono::duration_cast<sec>(wall));
+	stats.addTimer(ms(stats_intervals.clock), []() {}, EventLoop::clock::now() + to_next_second);
+
+	stats.after([sampler]() {
+		std::shared_ptr<const StatsSnapshot> snapshot = TakeSnapshot(sampler);
+		std::atomic_store(&latest_snapshot, snapshot);
+
+		// No global_lock, creating or destroying a swapchain elsewhere doesn't wait on
+		// the text. text_lock only keeps ShutdownSwapchainData from deleting the overlay
+		g_swapchain_data.for_each([&snapshot](void *, SwapchainData& swapchain_data) {
+			std::lock_guard<std::mutex> l(swapchain_data.text_lock);
+			updateTextOverlay(&swapchain_data, swapchain_data.overlay.load(), snapshot.get());
+		});
+	});
+
+	if (sampler->ss.fd > -1) {
+		stats.addReader(sampler->ss.fd, [sampler]() {
+			ReadSocket(sampler);
+		});
 	}
+
+	stats.start();
 }
 
-static void InitSocket(InstanceData& instance, const char * const sock_path)
+static void InitSocket(StatsSampler *sampler, const char * const sock_path)
 {
-	auto& ss = instance.ss;
-	ss.quit = false;
+	auto& ss = sampler->ss;
 	ss.fd = -1;
 
 	if (strlen(sock_path) >= sizeof(ss.addr.sun_path)) {
@@ -477,23 +659,46 @@ static void InitSocket(InstanceData& instance, const char * const sock_path)
 		}
 	}
 
-	struct timeval tv;
-	tv.tv_sec = 0;
-	tv.tv_usec = 100000; //100ms
-	if (setsockopt(ss.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-		perror("timeout");
-		goto error;
-	}
-
-	ss.thread = std::thread(SocketThread, &instance);
-
 	return;
 error:
 	if (ss.fd > -1) {
 		close(ss.fd);
+		ss.fd = -1;
 	}
 }
 
+// First subscriber starts the sampler, the last one to leave stops it.
+// Must not be called with global_lock held, the sampler's jobs take it.
+static void SamplerSubscribe()
+{
+	std::lock_guard<std::mutex> l(sampler_lock);
+	if (sampler_refs++)
+		return;
+
+	sampler = new StatsSampler();
+
+	char *env = getenv ("NUUDEL_SOCKET");
+	if (env)
+		InitSocket(sampler, env);
+
+	StartStatsLoop(sampler);
+}
+
+static void SamplerUnsubscribe()
+{
+	std::lock_guard<std::mutex> l(sampler_lock);
+	if (--sampler_refs)
+		return;
+
+	sampler->loop.stop();
+
+	if (sampler->ss.fd > -1)
+		close(sampler->ss.fd);
+
+	delete sampler;
+	sampler = nullptr;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////
 // Layer init and shutdown
 
@@ -603,29 +808,36 @@ VK_LAYER_EXPORT VkResult VKAPI_CALL Overlay_CreateInstance(
 		avg_cpus = !!env_avg_cpus;
 	}
 
-	env = getenv ("NUUDEL_SOCKET");
-	if (env) {
-		InitSocket(*GetInstanceData(*pInstance), env);
+	int env_inject_submit = 0;
+	env = getenv ("NUUDEL_INJECT_SUBMIT");
+	if (env && sscanf(env, "%d", &env_inject_submit) == 1) {
+		inject_submit = !!env_inject_submit;
+	}
+
+	int env_cpu, env_gpu, env_fps, env_clock;
+	env = getenv ("NUUDEL_INTERVALS");
+	if (env && sscanf(env, "%d,%d,%d,%d", &env_cpu, &env_gpu, &env_fps, &env_clock) == 4
+		&& env_cpu > 0 && env_gpu > 0 && env_fps > 0 && env_clock > 0) {
+		stats_intervals.cpu = env_cpu;
+		stats_intervals.gpu = env_gpu;
+		stats_intervals.fps = env_fps;
+		stats_intervals.clock = env_clock;
 	}
 
-	instance_data->cpu.thread = std::thread(StatsUpdateThread, instance_data);
+	// Devices are gone before their instance, so the instances alone keep it running
+	SamplerSubscribe();
 	return VK_SUCCESS;
 }
 
 VK_LAYER_EXPORT void VKAPI_CALL Overlay_DestroyInstance(VkInstance instance, const VkAllocationCallbacks* pAllocator)
 {
-	scoped_lock l(global_lock);
 	void *key = GetKey(instance);
 	InstanceData& id = g_instance_dispatch[key];
 
-	id.cpu.quit = true;
-	if (id.cpu.thread.joinable())
-		id.cpu.thread.join();
-
-	id.ss.quit = true;
-	if (id.ss.thread.joinable())
-		id.ss.thread.join();
+	// stats jobs take global_lock, so let go of the sampler before grabbing the lock
+	SamplerUnsubscribe();
 
+	scoped_lock l(global_lock);
 	id.vtable.DestroyInstance(instance, pAllocator);
 	g_instance_dispatch.erase(key);
 }
@@ -675,12 +887,43 @@ VK_LAYER_EXPORT VkResult VKAPI_CALL Overlay_CreateDevice(
 	GetDeviceData(*pDevice)->physical_device = physicalDevice;
 	GetDeviceData(*pDevice)->device = *pDevice;
 	GetDeviceData(*pDevice)->instance = instance;
+	GetDeviceData(*pDevice)->allocator = new HostAllocator(pAllocator);
 
 	VkLayerDeviceCreateInfo *load_data_info = get_device_chain_info(pCreateInfo, VK_LOADER_DATA_CALLBACK);
 	GetDeviceData(*pDevice)->set_device_loader_data = load_data_info->u.pfnSetDeviceLoaderData;
 
 	DeviceMapQueues(GetDeviceData(*pDevice), pCreateInfo);
 
+	if (TimelineSemaphoreEnabled(pCreateInfo)) {
+		bool khr = false;
+		for (uint32_t i = 0; i < pCreateInfo->enabledExtensionCount; i++)
+			khr |= !strcmp(pCreateInfo->ppEnabledExtensionNames[i], VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+
+		DeviceData *device_data = GetDeviceData(*pDevice);
+		device_data->GetSemaphoreCounterValue = (PFN_vkGetSemaphoreCounterValueKHR)
+			gdpa(*pDevice, khr ? "vkGetSemaphoreCounterValueKHR" : "vkGetSemaphoreCounterValue");
+		device_data->WaitSemaphores = (PFN_vkWaitSemaphoresKHR)
+			gdpa(*pDevice, khr ? "vkWaitSemaphoresKHR" : "vkWaitSemaphores");
+		device_data->timeline_semaphore = device_data->GetSemaphoreCounterValue && device_data->WaitSemaphores;
+	}
+
+	GetDeviceData(*pDevice)->storage_without_format = StorageWithoutFormatEnabled(pCreateInfo);
+
+	if (DynamicRenderingEnabled(pCreateInfo)) {
+		bool khr = false;
+		for (uint32_t i = 0; i < pCreateInfo->enabledExtensionCount; i++)
+			khr |= !strcmp(pCreateInfo->ppEnabledExtensionNames[i], VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME);
+
+		DeviceData *device_data = GetDeviceData(*pDevice);
+		device_data->CmdBeginRendering = (PFN_vkCmdBeginRenderingKHR)
+			gdpa(*pDevice, khr ? "vkCmdBeginRenderingKHR" : "vkCmdBeginRendering");
+		device_data->CmdEndRendering = (PFN_vkCmdEndRenderingKHR)
+			gdpa(*pDevice, khr ? "vkCmdEndRenderingKHR" : "vkCmdEndRendering");
+		device_data->dynamic_rendering = device_data->CmdBeginRendering && device_data->CmdEndRendering;
+	}
+	GetDeviceData(*pDevice)->QueueSubmit2 = (PFN_vkQueueSubmit2KHR)gdpa(*pDevice, "vkQueueSubmit2");
+	GetDeviceData(*pDevice)->QueueSubmit2KHR = (PFN_vkQueueSubmit2KHR)gdpa(*pDevice, "vkQueueSubmit2KHR");
+
 	GetDeviceData(*pDevice)->vulkanDevice = new vks::VulkanDevice(physicalDevice,
 		*pDevice, &GetDeviceData(*pDevice)->vtable, &instance->vtable);
 
@@ -712,7 +955,13 @@ VK_LAYER_EXPORT VkResult VKAPI_CALL Overlay_CreateDevice(
 	int env_amdgpu_index = 0;
 	char *env = getenv ("NUUDEL_AMDGPU_INDEX");
 	if (env && sscanf(env, "%d", &env_amdgpu_index) == 1)
-		GetDeviceData(*pDevice)->deviceStats = new AMDgpuStats(env_amdgpu_index);
+	{
+		auto sensors = std::make_shared<GPUSensors>();
+		sensors->stats.reset(new AMDgpuStats(env_amdgpu_index));
+		// The sampler copies the pointer under global_lock
+		scoped_lock l(global_lock);
+		GetDeviceData(*pDevice)->sensors = sensors;
+	}
 
 	return VK_SUCCESS;
 }
@@ -726,8 +975,17 @@ VK_LAYER_EXPORT void VKAPI_CALL Overlay_DestroyDevice(VkDevice device, const VkA
 
 	DeviceUnmapQueues(device_data);
 
+	delete device_data->overlay;
 	delete device_data->vulkanDevice;
-	delete device_data->deviceStats;
+	// The sampler may still be reading them, it drops its reference when done
+	device_data->sensors.reset();
+	delete device_data->allocator;
+
+#ifndef NDEBUG
+	HostAllocationStats host = HostAllocator::stats();
+	std::cerr << "Layer host allocations: " << host.allocations << " live (" << host.bytes
+		<< " bytes), " << host.total << " made" << std::endl;
+#endif
 
 	device_data->vtable.DestroyDevice(device, pAllocator);
 	g_device_dispatch.erase(key);
@@ -780,7 +1038,6 @@ VK_LAYER_EXPORT VkResult VKAPI_CALL Overlay_EnumerateDeviceExtensionProperties(
 		if(physicalDevice == VK_NULL_HANDLE)
 			return VK_SUCCESS;
 
-		scoped_lock l(global_lock);
 		return g_instance_dispatch[GetKey(physicalDevice)].vtable.EnumerateDeviceExtensionProperties(physicalDevice, pLayerName, pPropertyCount, pProperties);
 	}
 
@@ -790,6 +1047,8 @@ VK_LAYER_EXPORT VkResult VKAPI_CALL Overlay_EnumerateDeviceExtensionProperties(
 	return VK_SUCCESS;
 }
 
+static void SetupSwapchainOverlay(struct SwapchainData *data);
+
 static void SetupSwapchainData(struct SwapchainData *data,
 								const VkSwapchainCreateInfoKHR *pCreateInfo)
 {
@@ -799,46 +1058,6 @@ static void SetupSwapchainData(struct SwapchainData *data,
 
 	struct DeviceData *device_data = data->device;
 
-	/* Render pass */
-	VkAttachmentDescription attachment_desc = {};
-	attachment_desc.format = pCreateInfo->imageFormat;
-	attachment_desc.samples = VK_SAMPLE_COUNT_1_BIT;
-	attachment_desc.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
-	attachment_desc.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-	attachment_desc.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-	attachment_desc.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-	attachment_desc.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-	attachment_desc.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-	VkAttachmentReference color_attachment = {};
-	color_attachment.attachment = 0;
-	color_attachment.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-	VkSubpassDescription subpass = {};
-	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-	subpass.colorAttachmentCount = 1;
-	subpass.pColorAttachments = &color_attachment;
-
-	VkSubpassDependency dependency = {};
-	dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-	dependency.dstSubpass = 0;
-	dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependency.srcAccessMask = 0;
-	dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-
-	VkRenderPassCreateInfo render_pass_info = {};
-	render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-	render_pass_info.attachmentCount = 1;
-	render_pass_info.pAttachments = &attachment_desc;
-	render_pass_info.subpassCount = 1;
-	render_pass_info.pSubpasses = &subpass;
-	render_pass_info.dependencyCount = 1;
-	render_pass_info.pDependencies = &dependency;
-	VK_CHECK_RESULT(device_data->vtable.CreateRenderPass(device_data->device,
-												 &render_pass_info,
-												 NULL, &data->render_pass));
-
 	uint32_t n_images = 0;
 	VK_CHECK_RESULT(device_data->vtable.GetSwapchainImagesKHR(device_data->device,
 													  data->swapchain,
@@ -850,6 +1069,21 @@ static void SetupSwapchainData(struct SwapchainData *data,
 	data->framebuffers.resize(n_images);
 	data->submission_semaphore.resize(n_images);
 	data->fences.resize(n_images);
+	data->timeline_values.assign(n_images, 0);
+	data->injected.assign(n_images, false);
+
+	if (device_data->timeline_semaphore) {
+		VkSemaphoreTypeCreateInfo type_info = {};
+		type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+		type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+		type_info.initialValue = 0;
+
+		VkSemaphoreCreateInfo semaphore_info = {};
+		semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		semaphore_info.pNext = &type_info;
+		VK_CHECK_RESULT(device_data->vtable.CreateSemaphore(device_data->device, &semaphore_info,
+												data->allocator->get(), &data->timeline));
+	}
 
 	VK_CHECK_RESULT(device_data->vtable.GetSwapchainImagesKHR(device_data->device,
 													  data->swapchain,
@@ -869,15 +1103,46 @@ static void SetupSwapchainData(struct SwapchainData *data,
 	for (uint32_t i = 0; i < n_images; i++) {
 		view_info.image = data->images[i];
 		VK_CHECK_RESULT(device_data->vtable.CreateImageView(device_data->device,
-													&view_info, NULL,
+													&view_info, data->allocator->get(),
 													&data->image_views[i]));
 	}
 
+	data->setup_thread = std::thread(SetupSwapchainOverlay, data);
+}
+
+/* Runs on SwapchainData::setup_thread. Font generation, allocations and
+ * pipeline compiles stay off vkCreateSwapchainKHR, nothing here may take
+ * global_lock or use a queue.
+ */
+static void SetupSwapchainOverlay(struct SwapchainData *data)
+{
+	struct DeviceData *device_data = data->device;
+
+	/* Render pass, pipelines etc. survive swapchain recreation */
+	{
+		std::lock_guard<std::mutex> l(device_data->overlay_lock);
+		if (!device_data->overlay)
+			device_data->overlay = new OverlayShared(device_data->vulkanDevice, device_data->allocator->get());
+	}
+	/* Compute composite writes the images directly and dynamic rendering
+	 * draws to the image views, neither needs framebuffers.
+	 */
+	bool compute = data->compute && device_data->overlay->compute;
+	if (compute || device_data->overlay->dynamicRendering) {
+		TextOverlay *overlay = new TextOverlay(device_data->overlay, data->framebuffers,
+			data->format, data->width, data->height, &data->image_views, compute);
+		updateTextOverlay(data, overlay, std::atomic_load(&latest_snapshot).get());
+		data->overlay.store(overlay);
+		return;
+	}
+
+	const OverlayPipelines& pipelines = device_data->overlay->getPipelines(data->format);
+
 	/* Framebuffers */
 	VkImageView attachment[1];
 	VkFramebufferCreateInfo fb_info = {};
 	fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-	fb_info.renderPass = data->render_pass;
+	fb_info.renderPass = pipelines.renderPass;
 	fb_info.attachmentCount = 1;
 	fb_info.pAttachments = attachment;
 	fb_info.width = data->width;
@@ -886,42 +1151,79 @@ static void SetupSwapchainData(struct SwapchainData *data,
 	for (uint32_t i = 0; i < data->image_views.size(); i++) {
 		attachment[0] = data->image_views[i];
 		VK_CHECK_RESULT(device_data->vtable.CreateFramebuffer(device_data->device, &fb_info,
-													NULL, &data->framebuffers[i]));
+													data->allocator->get(), &data->framebuffers[i]));
 	}
 
-	data->overlay = new TextOverlay(device_data->vulkanDevice,
-		device_data->graphic_queue->queue, data->framebuffers,
+	TextOverlay *overlay = new TextOverlay(device_data->overlay, data->framebuffers,
 		data->format, data->width, data->height);
-	updateTextOverlay(data);
+	updateTextOverlay(data, overlay, std::atomic_load(&latest_snapshot).get());
+	data->overlay.store(overlay);
+}
+
+// Block until the swapchain's overlay submits reached `value`, usually they already have
+static void WaitTimeline(struct SwapchainData *data, uint64_t value)
+{
+	struct DeviceData *device_data = data->device;
+	uint64_t done = 0;
+	if (device_data->GetSemaphoreCounterValue(device_data->device, data->timeline, &done) == VK_SUCCESS && done >= value)
+		return;
+
+	VkSemaphoreWaitInfo wait_info = {};
+	wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	wait_info.semaphoreCount = 1;
+	wait_info.pSemaphores = &data->timeline;
+	wait_info.pValues = &value;
+	VK_CHECK_RESULT(device_data->WaitSemaphores(device_data->device, &wait_info, UINT64_MAX));
 }
 
 static void ShutdownSwapchainData(struct SwapchainData *data)
 {
 	struct DeviceData *device_data = data->device;
 
-	delete data->overlay;
-	data->overlay = nullptr;
+	if (data->setup_thread.joinable())
+		data->setup_thread.join();
+
+	// The overlay's command buffers, text buffers and cache may still be in flight
+	if (data->timeline)
+		WaitTimeline(data, data->timeline_value);
+	for (auto& fence : data->fences) {
+		if (fence)
+			fence->wait();
+	}
+
+	{
+		// Waits for a text update the sampler may be doing right now
+		std::lock_guard<std::mutex> l(data->text_lock);
+		delete data->overlay.exchange(nullptr);
+	}
+
+	if (data->timeline) {
+		device_data->vtable.DestroySemaphore(device_data->device, data->timeline, data->allocator->get());
+		data->timeline = VK_NULL_HANDLE;
+	}
 
 	for (uint32_t i = 0; i < data->images.size(); i++) {
-		device_data->vtable.DestroyImageView(device_data->device, data->image_views[i], NULL);
-		device_data->vtable.DestroyFramebuffer(device_data->device, data->framebuffers[i], NULL);
+		device_data->vtable.DestroyImageView(device_data->device, data->image_views[i], data->allocator->get());
+		device_data->vtable.DestroyFramebuffer(device_data->device, data->framebuffers[i], data->allocator->get());
 		if (data->submission_semaphore[i]) {
-			device_data->vtable.DestroySemaphore(device_data->device, data->submission_semaphore[i], NULL);
+			device_data->vtable.DestroySemaphore(device_data->device, data->submission_semaphore[i], data->allocator->get());
 			data->submission_semaphore[i] = 0;
 		}
-		if (data->fences[i]) {
-			device_data->vtable.DestroyFence(device_data->device, data->fences[i], NULL);
-			data->fences[i] = 0;
-		}
+		data->fences[i].reset();
 	}
 
-	device_data->vtable.DestroyRenderPass(device_data->device, data->render_pass, NULL);
+	delete data->allocator;
+	data->allocator = nullptr;
 }
 
+/* Record the overlay of one swapchain image and append its command buffers
+ * to the batch of the current present. The fence of an idle image is handed
+ * back through `reuse` if nothing else references it anymore.
+ */
 static void RenderSwapchainDisplay(struct SwapchainData *data,
-									const VkSemaphore *wait_semaphores,
-									unsigned n_wait_semaphores,
-									unsigned image_index)
+									unsigned image_index,
+									std::vector<VkCommandBuffer>& cmds,
+									std::shared_ptr<SubmitFence>& reuse)
 {
 	struct DeviceData *device_data = data->device;
 
@@ -952,46 +1254,33 @@ static void RenderSwapchainDisplay(struct SwapchainData *data,
 										  //0, nullptr, /* buffer memory barriers */
 										  //1, &imb);   /* image memory barriers */
 
-	if (data->fences[image_index]) {
-		if (device_data->vtable.GetFenceStatus(device_data->device, data->fences[image_index]) != VK_SUCCESS)
-			VK_CHECK_RESULT(device_data->vtable.WaitForFences(device_data->device, 1, &data->fences[image_index], VK_TRUE, UINT64_MAX));
-
-		device_data->vtable.ResetFences(device_data->device, 1,
-										&data->fences[image_index]);
-	} else {
-		VkFenceCreateInfo fence_info = {};
-		fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-		VK_CHECK_RESULT(device_data->vtable.CreateFence(device_data->device,
-			&fence_info,
-			NULL,
-			&data->fences[image_index]));
+	std::shared_ptr<SubmitFence>& fence = data->fences[image_index];
+	if (data->timeline) {
+		// Only waits if the GPU is still behind on this image's previous overlay
+		WaitTimeline(data, data->timeline_values[image_index]);
+	} else if (fence) {
+		fence->wait();
+		if (!reuse && fence.use_count() == 1) {
+			VK_CHECK_RESULT(device_data->vtable.ResetFences(device_data->device, 1, &fence->fence));
+			reuse = fence;
+		}
+		fence.reset();
 	}
 
-	/* draw stuff */
-	data->overlay->updateCommandBuffers(image_index, imb);
+	TextOverlay *overlay = data->overlay.load();
+
+	/* draw stuff, re-records only if the text changed */
+	overlay->updateCommandBuffers(image_index, imb);
 
 	if (!data->submission_semaphore[image_index]) {
 		/* Submission semaphore */
 		VkSemaphoreCreateInfo semaphore_info = {};
 		semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 		VK_CHECK_RESULT(device_data->vtable.CreateSemaphore(device_data->device, &semaphore_info,
-												NULL, &data->submission_semaphore[image_index]));
+												data->allocator->get(), &data->submission_semaphore[image_index]));
 	}
 
-	VkSubmitInfo submit_info = {};
-	VkPipelineStageFlags stage_wait = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-
-	submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submit_info.commandBufferCount = 0;
-	//submit_info.pCommandBuffers = &command_buffer;
-	submit_info.pWaitDstStageMask = &stage_wait;
-	submit_info.waitSemaphoreCount = n_wait_semaphores;
-	submit_info.pWaitSemaphores = wait_semaphores;
-	submit_info.signalSemaphoreCount = 1;
-	submit_info.pSignalSemaphores = &data->submission_semaphore[image_index];
-
-	// Submit text overlay to queue
-	data->overlay->submit(device_data->graphic_queue->queue, image_index, submit_info, data->fences[image_index]);
+	overlay->appendCommandBuffers(image_index, cmds);
 }
 
 VK_LAYER_EXPORT void VKAPI_CALL Overlay_DestroySwapchainKHR(
@@ -1009,53 +1298,403 @@ VK_LAYER_EXPORT void VKAPI_CALL Overlay_DestroySwapchainKHR(
 	}
 }
 
+// Learn which semaphores the application presents a swapchain with, the submit
+// that signals one of them is the last one drawing into the image
+static void RememberPresentWaits(struct SwapchainData *data, const VkPresentInfoKHR *pPresentInfo)
+{
+	for (uint32_t i = 0; i < pPresentInfo->waitSemaphoreCount; i++) {
+		VkSemaphore semaphore = pPresentInfo->pWaitSemaphores[i];
+		if (std::find(data->present_waits.begin(), data->present_waits.end(), semaphore) != data->present_waits.end())
+			continue;
+		// Apps that make new semaphores all the time don't get to grow this forever
+		if (data->present_waits.size() >= 2 * data->images.size())
+			data->present_waits.erase(data->present_waits.begin());
+		data->present_waits.push_back(semaphore);
+	}
+}
+
 VK_LAYER_EXPORT VkResult VKAPI_CALL Overlay_QueuePresentKHR(
 	VkQueue                                     queue,
 	const VkPresentInfoKHR*                     pPresentInfo)
 {
-	VkResult result = VK_SUCCESS;
 	QueueData *queue_data = GetQueueData(queue);
+	DeviceData *device_data = queue_data->device;
+
+	/* The overlays of every swapchain in this present go out in one submit,
+	 * signalling one semaphore per swapchain, and the present stays a single
+	 * call that waits on all of them.
+	 */
+	std::vector<VkCommandBuffer> cmds;
+	std::vector<VkSemaphore> semaphores;
+	std::vector<std::shared_ptr<SubmitFence> *> fence_slots;
+	std::shared_ptr<SubmitFence> fence;
+	// Timeline signals go after the binary ones, which ignore their values
+	std::vector<VkSemaphore> timelines;
+	std::vector<uint64_t> timeline_values;
+
+	/* Submits on other threads may inject into the same swapchains. Locked in
+	 * address order so two presents sharing swapchains can't deadlock.
+	 */
+	std::vector<SwapchainData *> swapchains;
+	for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++)
+		swapchains.push_back(GetSwapchainData((void*)pPresentInfo->pSwapchains[i]));
+	std::sort(swapchains.begin(), swapchains.end());
+	swapchains.erase(std::unique(swapchains.begin(), swapchains.end()), swapchains.end());
+	std::vector<std::unique_lock<std::mutex>> locks;
+	for (SwapchainData *swapchain_data : swapchains)
+		locks.emplace_back(swapchain_data->submit_lock);
 
 	for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++) {
-		VkSwapchainKHR swapchain = pPresentInfo->pSwapchains[i];
-
-		SwapchainData *swapchain_data = GetSwapchainData((void*)swapchain);
+		SwapchainData *swapchain_data = GetSwapchainData((void*)pPresentInfo->pSwapchains[i]);
 		PresentStats& ps = swapchain_data->stats;
-		ps.n_frames_since_update ++;
+		ps.n_frames_since_update.fetch_add(1, std::memory_order_relaxed);
+
+		unsigned image_index = pPresentInfo->pImageIndices[i];
+		if (inject_submit) {
+			RememberPresentWaits(swapchain_data, pPresentInfo);
+			auto it = std::find(swapchain_data->acquired.begin(), swapchain_data->acquired.end(), image_index);
+			if (it != swapchain_data->acquired.end())
+				swapchain_data->acquired.erase(it);
+		}
 
-		VkPresentInfoKHR present_info = *pPresentInfo;
-		present_info.swapchainCount = 1;
-		present_info.pSwapchains = &swapchain;
+		/* Overlay still being set up, present as is */
+		if (!swapchain_data->overlay.load())
+			continue;
 
-		RenderSwapchainDisplay(swapchain_data,
-					pPresentInfo->pWaitSemaphores,
-					pPresentInfo->waitSemaphoreCount,
-					pPresentInfo->pImageIndices[i]);
+		/* Already drawn by the application's own submit */
+		if (swapchain_data->injected[image_index]) {
+			swapchain_data->injected[image_index] = false;
+			continue;
+		}
+		RenderSwapchainDisplay(swapchain_data, image_index, cmds, fence);
+		semaphores.push_back(swapchain_data->submission_semaphore[image_index]);
+		if (swapchain_data->timeline) {
+			swapchain_data->timeline_values[image_index] = ++swapchain_data->timeline_value;
+			timelines.push_back(swapchain_data->timeline);
+			timeline_values.push_back(swapchain_data->timeline_value);
+		} else {
+			fence_slots.push_back(&swapchain_data->fences[image_index]);
+		}
+	}
+
+	VkPresentInfoKHR present_info = *pPresentInfo;
+	if (!semaphores.empty()) {
+		size_t n_binary = semaphores.size();
+		if (!fence_slots.empty() && !fence)
+			fence = std::make_shared<SubmitFence>(device_data);
+
+		std::vector<VkPipelineStageFlags> stage_wait(pPresentInfo->waitSemaphoreCount, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+
+		VkSubmitInfo submit_info = {};
+		submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submit_info.waitSemaphoreCount = pPresentInfo->waitSemaphoreCount;
+		submit_info.pWaitSemaphores = pPresentInfo->pWaitSemaphores;
+		submit_info.pWaitDstStageMask = stage_wait.data();
+		submit_info.commandBufferCount = cmds.size();
+		submit_info.pCommandBuffers = cmds.data();
+
+		VkTimelineSemaphoreSubmitInfo timeline_info = {};
+		if (!timelines.empty()) {
+			timeline_values.insert(timeline_values.begin(), n_binary, 0);
+			semaphores.insert(semaphores.end(), timelines.begin(), timelines.end());
+
+			timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+			timeline_info.signalSemaphoreValueCount = timeline_values.size();
+			timeline_info.pSignalSemaphoreValues = timeline_values.data();
+			submit_info.pNext = &timeline_info;
+		}
+		submit_info.signalSemaphoreCount = semaphores.size();
+		submit_info.pSignalSemaphores = semaphores.data();
+
+		VK_CHECK_RESULT(device_data->vtable.QueueSubmit(device_data->graphic_queue->queue, 1, &submit_info,
+			fence ? fence->fence : VK_NULL_HANDLE));
+		if (fence) {
+			fence->pending = true;
+			for (auto slot : fence_slots)
+				*slot = fence;
+		}
 
 		/* Because the submission of the overlay draw waits on the semaphores
 		* handed for present, we don't need to have this present operation
 		* wait on them as well, we can just wait on the overlay submission
-		* semaphore.
+		* semaphores. That covers the swapchains without an overlay too.
 		*/
-		present_info.pWaitSemaphores = &swapchain_data->submission_semaphore[pPresentInfo->pImageIndices[i]];
-		present_info.waitSemaphoreCount = 1;
+		present_info.pWaitSemaphores = semaphores.data();
+		present_info.waitSemaphoreCount = n_binary;
+	}
+	locks.clear();
 
-		VkResult chain_result;
-		{
-			//scoped_lock l(global_lock);
-			//chain_result = g_device_dispatch[GetKey(queue)].vtable.QueuePresentKHR(queue, pPresentInfo);
-			chain_result= queue_data->device->vtable.QueuePresentKHR(queue, &present_info);
+	return device_data->vtable.QueuePresentKHR(queue, &present_info);
+}
+
+static void RememberAcquire(VkSwapchainKHR swapchain, VkResult result, uint32_t image_index)
+{
+	if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
+		return;
+	SwapchainData *swapchain_data = g_swapchain_data.find((void*)swapchain);
+	if (!swapchain_data)
+		return;
+
+	std::lock_guard<std::mutex> l(swapchain_data->submit_lock);
+	auto& acquired = swapchain_data->acquired;
+	if (std::find(acquired.begin(), acquired.end(), image_index) == acquired.end())
+		acquired.push_back(image_index);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL Overlay_AcquireNextImageKHR(
+	VkDevice                                    device,
+	VkSwapchainKHR                              swapchain,
+	uint64_t                                    timeout,
+	VkSemaphore                                 semaphore,
+	VkFence                                     fence,
+	uint32_t*                                   pImageIndex)
+{
+	VkResult result = GetDeviceData(device)->vtable.AcquireNextImageKHR(device, swapchain, timeout, semaphore, fence, pImageIndex);
+	if (inject_submit)
+		RememberAcquire(swapchain, result, *pImageIndex);
+	return result;
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL Overlay_AcquireNextImage2KHR(
+	VkDevice                                    device,
+	const VkAcquireNextImageInfoKHR*            pAcquireInfo,
+	uint32_t*                                   pImageIndex)
+{
+	VkResult result = GetDeviceData(device)->vtable.AcquireNextImage2KHR(device, pAcquireInfo, pImageIndex);
+	if (inject_submit)
+		RememberAcquire(pAcquireInfo->swapchain, result, *pImageIndex);
+	return result;
+}
+
+/* Swapchain whose acquired image is presented once `semaphore` signals, if
+ * any, returned with its submit_lock held in `lock`. Applications reuse
+ * present semaphores per frame in flight, not per image, so the image is only
+ * known while exactly one is acquired and not presented yet.
+ */
+static SwapchainData *FindInjectTarget(QueueData *queue_data, VkSemaphore semaphore,
+									std::unique_lock<std::mutex>& lock)
+{
+	SwapchainData *found = nullptr;
+	g_swapchain_data.for_each([&](void *, SwapchainData& data) {
+		if (found || data.device != queue_data->device || !data.overlay.load())
+			return;
+
+		std::unique_lock<std::mutex> l(data.submit_lock);
+		if (data.acquired.size() != 1 || data.injected[data.acquired[0]])
+			return;
+		if (std::find(data.present_waits.begin(), data.present_waits.end(), semaphore) != data.present_waits.end()) {
+			found = &data;
+			lock = std::move(l);
 		}
+	});
+	return found;
+}
 
-		if (pPresentInfo->pResults)
-			pPresentInfo->pResults[i] = chain_result;
-		if (chain_result != VK_SUCCESS && result == VK_SUCCESS)
-			result = chain_result;
+// Injection needs a way to know when the overlay command buffers are done:
+// the swapchain's timeline semaphore, or a fence if the application has none
+// on this submit. Only on the queue the layer submits to itself, the batch can
+// carry the atlas upload or a cache redraw that every other overlay of the
+// device samples, and submission order on that queue is what orders them.
+static bool CanInject(QueueData *queue_data, SwapchainData *data, VkFence fence)
+{
+	return queue_data == queue_data->device->graphic_queue
+		&& (data->timeline || fence == VK_NULL_HANDLE);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL Overlay_QueueSubmit(
+	VkQueue                                     queue,
+	uint32_t                                    submitCount,
+	const VkSubmitInfo*                         pSubmits,
+	VkFence                                     fence)
+{
+	QueueData *queue_data = GetQueueData(queue);
+	DeviceData *device_data = queue_data->device;
+
+	if (!inject_submit)
+		return device_data->vtable.QueueSubmit(queue, submitCount, pSubmits, fence);
+
+	// Latest batch that signals a present semaphore
+	SwapchainData *data = nullptr;
+	std::unique_lock<std::mutex> lock;
+	uint32_t n = submitCount;
+	while (!data && n-- > 0) {
+		for (uint32_t j = 0; j < pSubmits[n].signalSemaphoreCount && !data; j++)
+			data = FindInjectTarget(queue_data, pSubmits[n].pSignalSemaphores[j], lock);
 	}
 
+	// A timeline submit info can only be replaced at the head of the chain
+	const VkTimelineSemaphoreSubmitInfo *app_timeline = nullptr;
+	if (data && data->timeline) {
+		vk_foreach_struct_const(item, pSubmits[n].pNext) {
+			if (item->sType == VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO) {
+				if (item != pSubmits[n].pNext)
+					data = nullptr;
+				else
+					app_timeline = (const VkTimelineSemaphoreSubmitInfo *)item;
+				break;
+			}
+		}
+	}
+
+	if (!data || !CanInject(queue_data, data, fence))
+		return device_data->vtable.QueueSubmit(queue, submitCount, pSubmits, fence);
+
+	uint32_t image_index = data->acquired[0];
+	std::vector<VkSubmitInfo> submits(pSubmits, pSubmits + submitCount);
+	VkSubmitInfo& batch = submits[n];
+
+	std::shared_ptr<SubmitFence> overlay_fence;
+	std::vector<VkCommandBuffer> cmds(batch.pCommandBuffers, batch.pCommandBuffers + batch.commandBufferCount);
+	RenderSwapchainDisplay(data, image_index, cmds, overlay_fence);
+	batch.commandBufferCount = cmds.size();
+	batch.pCommandBuffers = cmds.data();
+
+	std::vector<VkSemaphore> signals;
+	std::vector<uint64_t> values;
+	VkTimelineSemaphoreSubmitInfo timeline_info = {};
+	if (data->timeline) {
+		signals.assign(batch.pSignalSemaphores, batch.pSignalSemaphores + batch.signalSemaphoreCount);
+		if (app_timeline && app_timeline->signalSemaphoreValueCount)
+			values.assign(app_timeline->pSignalSemaphoreValues, app_timeline->pSignalSemaphoreValues + app_timeline->signalSemaphoreValueCount);
+		else
+			values.assign(batch.signalSemaphoreCount, 0);
+
+		data->timeline_values[image_index] = ++data->timeline_value;
+		signals.push_back(data->timeline);
+		values.push_back(data->timeline_value);
+
+		if (app_timeline)
+			timeline_info = *app_timeline;
+		else {
+			timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+			timeline_info.pNext = batch.pNext;
+		}
+		timeline_info.signalSemaphoreValueCount = values.size();
+		timeline_info.pSignalSemaphoreValues = values.data();
+		batch.pNext = &timeline_info;
+		batch.signalSemaphoreCount = signals.size();
+		batch.pSignalSemaphores = signals.data();
+	} else if (!overlay_fence) {
+		overlay_fence = std::make_shared<SubmitFence>(device_data);
+	}
+
+	VkResult result = device_data->vtable.QueueSubmit(queue, submitCount, submits.data(),
+		overlay_fence ? overlay_fence->fence : fence);
+	if (overlay_fence) {
+		overlay_fence->pending = result == VK_SUCCESS;
+		data->fences[image_index] = overlay_fence;
+	}
+	data->injected[image_index] = result == VK_SUCCESS;
 	return result;
 }
 
+static VkResult InjectQueueSubmit2(PFN_vkQueueSubmit2KHR next,
+	VkQueue                                     queue,
+	uint32_t                                    submitCount,
+	const VkSubmitInfo2KHR*                     pSubmits,
+	VkFence                                     fence)
+{
+	QueueData *queue_data = GetQueueData(queue);
+	DeviceData *device_data = queue_data->device;
+
+	if (!inject_submit)
+		return next(queue, submitCount, pSubmits, fence);
+
+	SwapchainData *data = nullptr;
+	std::unique_lock<std::mutex> lock;
+	uint32_t n = submitCount;
+	while (!data && n-- > 0) {
+		for (uint32_t j = 0; j < pSubmits[n].signalSemaphoreInfoCount && !data; j++)
+			data = FindInjectTarget(queue_data, pSubmits[n].pSignalSemaphoreInfos[j].semaphore, lock);
+	}
+
+	if (!data || !CanInject(queue_data, data, fence))
+		return next(queue, submitCount, pSubmits, fence);
+
+	uint32_t image_index = data->acquired[0];
+	std::vector<VkSubmitInfo2KHR> submits(pSubmits, pSubmits + submitCount);
+	VkSubmitInfo2KHR& batch = submits[n];
+
+	std::shared_ptr<SubmitFence> overlay_fence;
+	std::vector<VkCommandBuffer> cmds;
+	RenderSwapchainDisplay(data, image_index, cmds, overlay_fence);
+
+	std::vector<VkCommandBufferSubmitInfoKHR> cmd_infos(batch.pCommandBufferInfos, batch.pCommandBufferInfos + batch.commandBufferInfoCount);
+	for (VkCommandBuffer cmd : cmds) {
+		VkCommandBufferSubmitInfoKHR info = {};
+		info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO_KHR;
+		info.commandBuffer = cmd;
+		cmd_infos.push_back(info);
+	}
+	batch.commandBufferInfoCount = cmd_infos.size();
+	batch.pCommandBufferInfos = cmd_infos.data();
+
+	std::vector<VkSemaphoreSubmitInfoKHR> signals(batch.pSignalSemaphoreInfos, batch.pSignalSemaphoreInfos + batch.signalSemaphoreInfoCount);
+	if (data->timeline) {
+		data->timeline_values[image_index] = ++data->timeline_value;
+
+		VkSemaphoreSubmitInfoKHR info = {};
+		info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO_KHR;
+		info.semaphore = data->timeline;
+		info.value = data->timeline_value;
+		info.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT_KHR;
+		signals.push_back(info);
+		batch.signalSemaphoreInfoCount = signals.size();
+		batch.pSignalSemaphoreInfos = signals.data();
+	} else if (!overlay_fence) {
+		overlay_fence = std::make_shared<SubmitFence>(device_data);
+	}
+
+	VkResult result = next(queue, submitCount, submits.data(), overlay_fence ? overlay_fence->fence : fence);
+	if (overlay_fence) {
+		overlay_fence->pending = result == VK_SUCCESS;
+		data->fences[image_index] = overlay_fence;
+	}
+	data->injected[image_index] = result == VK_SUCCESS;
+	return result;
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL Overlay_QueueSubmit2(
+	VkQueue                                     queue,
+	uint32_t                                    submitCount,
+	const VkSubmitInfo2KHR*                     pSubmits,
+	VkFence                                     fence)
+{
+	return InjectQueueSubmit2(GetQueueData(queue)->device->QueueSubmit2, queue, submitCount, pSubmits, fence);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL Overlay_QueueSubmit2KHR(
+	VkQueue                                     queue,
+	uint32_t                                    submitCount,
+	const VkSubmitInfo2KHR*                     pSubmits,
+	VkFence                                     fence)
+{
+	return InjectQueueSubmit2(GetQueueData(queue)->device->QueueSubmit2KHR, queue, submitCount, pSubmits, fence);
+}
+
+/* Add storage usage to the swapchain for the compute composite, if the surface
+ * and format can do it. Returns false to keep the render pass path.
+ */
+static bool RequestStorageUsage(DeviceData *device_data, VkSwapchainCreateInfoKHR& info)
+{
+	if (!OverlayShared::computeRequested() || !device_data->storage_without_format)
+		return false;
+
+	InstanceData *instance_data = device_data->instance;
+	VkFormatProperties format_props;
+	instance_data->vtable.GetPhysicalDeviceFormatProperties(device_data->physical_device, info.imageFormat, &format_props);
+	if (!(format_props.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT))
+		return false;
+
+	VkSurfaceCapabilitiesKHR caps;
+	if (instance_data->vtable.GetPhysicalDeviceSurfaceCapabilitiesKHR(device_data->physical_device, info.surface, &caps) != VK_SUCCESS
+		|| !(caps.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT))
+		return false;
+
+	info.imageUsage |= VK_IMAGE_USAGE_STORAGE_BIT;
+	return true;
+}
+
 VK_LAYER_EXPORT VkResult Overlay_CreateSwapchainKHR(
 	VkDevice                                    device,
 	const VkSwapchainCreateInfoKHR*             pCreateInfo,
@@ -1068,13 +1707,21 @@ VK_LAYER_EXPORT VkResult Overlay_CreateSwapchainKHR(
 	{
 		scoped_lock l(global_lock);
 
-		VkResult result = g_device_dispatch[GetKey(device)].vtable.CreateSwapchainKHR(device, pCreateInfo, pAllocator, pSwapchain);
+		DeviceData *device_data = &g_device_dispatch[GetKey(device)];
+		VkSwapchainCreateInfoKHR create_info = *pCreateInfo;
+		bool compute = RequestStorageUsage(device_data, create_info);
+
+		VkResult result = device_data->vtable.CreateSwapchainKHR(device, &create_info, pAllocator, pSwapchain);
 		if (result != VK_SUCCESS) return result;
 
 		swapchain_data = &g_swapchain_data[(void*)*pSwapchain];
 		swapchain_data->swapchain = *pSwapchain;
-		swapchain_data->device = &g_device_dispatch[GetKey(device)];
-		SetupSwapchainData(swapchain_data, pCreateInfo);
+		swapchain_data->device = device_data;
+		swapchain_data->compute = compute;
+		swapchain_data->stats.last_fps_update = hrc::now();
+		// Without callbacks of its own the swapchain's objects go to the device's
+		swapchain_data->allocator = new HostAllocator(pAllocator ? pAllocator : device_data->allocator->application());
+		SetupSwapchainData(swapchain_data, &create_info);
 	}
 	return result;
 }
@@ -1085,55 +1732,55 @@ VK_LAYER_EXPORT VkResult Overlay_CreateSwapchainKHR(
 extern "C" {
 #endif
 
-#define GETPROCADDR(func) if(!strcmp(pName, "vk" #func)) return (PFN_vkVoidFunction)&Overlay_##func;
+VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL Overlay_GetDeviceProcAddr(VkDevice device, const char *pName);
+VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL Overlay_GetInstanceProcAddr(VkInstance instance, const char *pName);
+
+#define PROC_NAME(func) "vk" #func,
+#define PROC_FUNC(func) (PFN_vkVoidFunction)&Overlay_##func,
+
+// Names are hashed at compile time, a lookup is one hash and one strcmp
+static constexpr const char *device_proc_names[] = { DEVICE_CHAIN_PROCS(PROC_NAME) DEVICE_PROCS(PROC_NAME) };
+static const PFN_vkVoidFunction device_proc_funcs[] = { DEVICE_CHAIN_PROCS(PROC_FUNC) DEVICE_PROCS(PROC_FUNC) };
+static constexpr auto device_proc_hash = make_perfect_hash(device_proc_names);
+
+static constexpr const char *instance_proc_names[] = { INSTANCE_PROCS(PROC_NAME) DEVICE_CHAIN_PROCS(PROC_NAME) };
+static const PFN_vkVoidFunction instance_proc_funcs[] = { INSTANCE_PROCS(PROC_FUNC) DEVICE_CHAIN_PROCS(PROC_FUNC) };
+static constexpr auto instance_proc_hash = make_perfect_hash(instance_proc_names);
+
+#undef PROC_NAME
+#undef PROC_FUNC
+
+// Optional entry points are only handed out if the next layer or driver has them,
+// both to not call through a null pointer and so probing for support still works
+static bool DeviceProcAvailable(VkDevice device, PFN_vkVoidFunction func)
+{
+	if (func == (PFN_vkVoidFunction)&Overlay_QueueSubmit2)
+		return GetDeviceData(device)->QueueSubmit2 != nullptr;
+	if (func == (PFN_vkVoidFunction)&Overlay_QueueSubmit2KHR)
+		return GetDeviceData(device)->QueueSubmit2KHR != nullptr;
+	if (func == (PFN_vkVoidFunction)&Overlay_AcquireNextImage2KHR)
+		return GetDeviceData(device)->vtable.AcquireNextImage2KHR != nullptr;
+	return true;
+}
 
 VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL Overlay_GetDeviceProcAddr(VkDevice device, const char *pName)
 {
 	//printf("%s: %s\n", __func__, pName);
-	// device chain functions we intercept
-	GETPROCADDR(GetDeviceProcAddr);
-	GETPROCADDR(EnumerateDeviceLayerProperties);
-	GETPROCADDR(EnumerateDeviceExtensionProperties);
-	GETPROCADDR(CreateDevice);
-	GETPROCADDR(DestroyDevice);
-	//GETPROCADDR(BeginCommandBuffer);
-	//GETPROCADDR(CmdDraw);
-	//GETPROCADDR(CmdDrawIndexed);
-	//GETPROCADDR(EndCommandBuffer);
-	GETPROCADDR(QueuePresentKHR);
-	GETPROCADDR(CreateSwapchainKHR);
-	GETPROCADDR(DestroySwapchainKHR);
+	int index = device_proc_hash.lookup(pName);
+	if (index >= 0)
+		return DeviceProcAvailable(device, device_proc_funcs[index]) ? device_proc_funcs[index] : nullptr;
 
-	{
-		scoped_lock l(global_lock);
-		return g_device_dispatch[GetKey(device)].vtable.GetDeviceProcAddr(device, pName);
-	}
+	// next layer's GetDeviceProcAddr is cached in the device's dispatch table
+	return g_device_dispatch[GetKey(device)].vtable.GetDeviceProcAddr(device, pName);
 }
 
 VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL Overlay_GetInstanceProcAddr(VkInstance instance, const char *pName)
 {
-	// instance chain functions we intercept
-	GETPROCADDR(GetInstanceProcAddr);
-	GETPROCADDR(EnumerateInstanceLayerProperties);
-	GETPROCADDR(EnumerateInstanceExtensionProperties);
-	GETPROCADDR(CreateInstance);
-	GETPROCADDR(DestroyInstance);
-
-	// device chain functions we intercept
-	GETPROCADDR(GetDeviceProcAddr);
-	GETPROCADDR(EnumerateDeviceLayerProperties);
-	GETPROCADDR(EnumerateDeviceExtensionProperties);
-	GETPROCADDR(CreateDevice);
-	GETPROCADDR(DestroyDevice);
-	//GETPROCADDR(BeginCommandBuffer);
-	//GETPROCADDR(CmdDraw);
-	//GETPROCADDR(CmdDrawIndexed);
-	//GETPROCADDR(EndCommandBuffer);
+	int index = instance_proc_hash.lookup(pName);
+	if (index >= 0)
+		return instance_proc_funcs[index];
 
-	{
-		scoped_lock l(global_lock);
-		return g_instance_dispatch[GetKey(instance)].vtable.GetInstanceProcAddr(instance, pName);
-	}
+	return g_instance_dispatch[GetKey(instance)].vtable.GetInstanceProcAddr(instance, pName);
 }
 
 #ifdef __cplusplus
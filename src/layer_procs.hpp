@@ -0,0 +1,38 @@
+#pragma once
+
+/*
+	X-macro lists of the entry points the layer intercepts, without the vk
+	prefix. Kept apart from layer.cpp so tests/ can check the name lookup
+	without pulling in Vulkan.
+*/
+
+// instance chain functions we intercept
+#define INSTANCE_PROCS(X) \
+	X(GetInstanceProcAddr) \
+	X(EnumerateInstanceLayerProperties) \
+	X(EnumerateInstanceExtensionProperties) \
+	X(CreateInstance) \
+	X(DestroyInstance)
+
+// device chain functions we intercept, also handed out through GetInstanceProcAddr
+#define DEVICE_CHAIN_PROCS(X) \
+	X(GetDeviceProcAddr) \
+	X(EnumerateDeviceLayerProperties) \
+	X(EnumerateDeviceExtensionProperties) \
+	X(CreateDevice) \
+	X(DestroyDevice)
+
+// device functions we intercept
+#define DEVICE_PROCS(X) \
+	X(QueuePresentKHR) \
+	X(QueueSubmit) \
+	X(QueueSubmit2) \
+	X(QueueSubmit2KHR) \
+	X(AcquireNextImageKHR) \
+	X(AcquireNextImage2KHR) \
+	X(CreateSwapchainKHR) \
+	X(DestroySwapchainKHR)
+	//X(BeginCommandBuffer)
+	//X(CmdDraw)
+	//X(CmdDrawIndexed)
+	//X(EndCommandBuffer)
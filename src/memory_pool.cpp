@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <iostream>
+#include "memory_pool.hpp"
+
+static inline VkDeviceSize alignUp(VkDeviceSize v, VkDeviceSize alignment)
+{
+	return (v + alignment - 1) / alignment * alignment;
+}
+
+MemoryPool::~MemoryPool()
+{
+	for (auto& block : blocks)
+		vulkanDevice->getDispatch()->FreeMemory(vulkanDevice->logicalDevice, block.memory, allocator);
+}
+
+MemoryAllocation MemoryPool::allocate(const VkMemoryRequirements& memReqs, VkMemoryPropertyFlags properties, bool image)
+{
+	std::lock_guard<std::mutex> l(mutex);
+	MemoryAllocation allocation;
+
+	for (auto& block : blocks) {
+		if (block.image != image || !(memReqs.memoryTypeBits & (1u << block.memoryType)))
+			continue;
+		if ((vulkanDevice->memoryProperties.memoryTypes[block.memoryType].propertyFlags & properties) != properties)
+			continue;
+
+		for (size_t i = 0; i < block.free.size(); i++) {
+			Range r = block.free[i];
+			VkDeviceSize offset = alignUp(r.offset, memReqs.alignment);
+			if (offset + memReqs.size > r.offset + r.size)
+				continue;
+
+			// Keep what is left on either side of the allocation
+			std::vector<Range> left;
+			if (offset > r.offset)
+				left.push_back({ r.offset, offset - r.offset });
+			if (offset + memReqs.size < r.offset + r.size)
+				left.push_back({ offset + memReqs.size, r.offset + r.size - offset - memReqs.size });
+			block.free.erase(block.free.begin() + i);
+			block.free.insert(block.free.begin() + i, left.begin(), left.end());
+
+			block.used += memReqs.size;
+			allocation.memory = block.memory;
+			allocation.offset = offset;
+			allocation.size = memReqs.size;
+			allocation.mapped = block.mapped ? block.mapped + offset : nullptr;
+			return allocation;
+		}
+	}
+
+	// Nothing fits, start a new block with the allocation at its beginning
+	Block block {};
+	block.size = std::max<VkDeviceSize>(MEMORYPOOL_BLOCK_SIZE, memReqs.size);
+	block.used = memReqs.size;
+	block.memoryType = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, properties);
+	block.image = image;
+	if (block.size > memReqs.size)
+		block.free.push_back({ memReqs.size, block.size - memReqs.size });
+
+	VkMemoryAllocateInfo allocInfo = vks::initializers::memoryAllocateInfo();
+	allocInfo.allocationSize = block.size;
+	allocInfo.memoryTypeIndex = block.memoryType;
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateMemory(vulkanDevice->logicalDevice, &allocInfo, allocator, &block.memory));
+
+	if (vulkanDevice->memoryProperties.memoryTypes[block.memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->MapMemory(vulkanDevice->logicalDevice, block.memory, 0, VK_WHOLE_SIZE, 0, (void **)&block.mapped));
+
+	blocks.push_back(block);
+	footprintSize += block.size;
+#ifndef NDEBUG
+	std::cerr << "Overlay device memory: " << footprintSize / 1024 << " KiB in " << blocks.size() << " blocks" << std::endl;
+#endif
+
+	allocation.memory = block.memory;
+	allocation.offset = 0;
+	allocation.size = memReqs.size;
+	allocation.mapped = block.mapped;
+	return allocation;
+}
+
+MemoryAllocation MemoryPool::bindBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties)
+{
+	VkMemoryRequirements memReqs;
+	vulkanDevice->getDispatch()->GetBufferMemoryRequirements(vulkanDevice->logicalDevice, buffer, &memReqs);
+	MemoryAllocation allocation = allocate(memReqs, properties, false);
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->BindBufferMemory(vulkanDevice->logicalDevice, buffer, allocation.memory, allocation.offset));
+	return allocation;
+}
+
+MemoryAllocation MemoryPool::bindImage(VkImage image, VkMemoryPropertyFlags properties)
+{
+	VkMemoryRequirements memReqs;
+	vulkanDevice->getDispatch()->GetImageMemoryRequirements(vulkanDevice->logicalDevice, image, &memReqs);
+	MemoryAllocation allocation = allocate(memReqs, properties, true);
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->BindImageMemory(vulkanDevice->logicalDevice, image, allocation.memory, allocation.offset));
+	return allocation;
+}
+
+void MemoryPool::free(MemoryAllocation& allocation)
+{
+	if (!allocation.memory)
+		return;
+
+	std::lock_guard<std::mutex> l(mutex);
+	auto block = std::find_if(blocks.begin(), blocks.end(),
+		[&](const Block& b) { return b.memory == allocation.memory; });
+	if (block == blocks.end()) {
+		std::cerr << "MemoryPool: freeing memory that is not from this pool" << std::endl;
+		return;
+	}
+
+	// Already in the free list, freed twice
+	auto& free = block->free;
+	auto next = std::lower_bound(free.begin(), free.end(), allocation.offset,
+		[](const Range& r, VkDeviceSize offset) { return r.offset < offset; });
+	if ((next != free.end() && next->offset < allocation.offset + allocation.size)
+		|| (next != free.begin() && (next - 1)->offset + (next - 1)->size > allocation.offset)
+		|| allocation.size > block->used) {
+		std::cerr << "MemoryPool: double free at offset " << allocation.offset << std::endl;
+		return;
+	}
+
+	block->used -= allocation.size;
+	if (block->used == 0) {
+		// Unmapped implicitly
+		vulkanDevice->getDispatch()->FreeMemory(vulkanDevice->logicalDevice, block->memory, allocator);
+		footprintSize -= block->size;
+		blocks.erase(block);
+		allocation = {};
+		return;
+	}
+
+	// Put the range back and merge it with its neighbours
+	next = free.insert(next, { allocation.offset, allocation.size });
+	if (next + 1 != free.end() && next->offset + next->size == (next + 1)->offset) {
+		next->size += (next + 1)->size;
+		free.erase(next + 1);
+	}
+	if (next != free.begin() && (next - 1)->offset + (next - 1)->size == next->offset) {
+		(next - 1)->size += next->size;
+		free.erase(next);
+	}
+	allocation = {};
+}
+
+void MemoryPool::flush(const MemoryAllocation& allocation)
+{
+	VkDeviceSize blockSize = 0;
+	uint32_t memoryType = 0;
+	{
+		std::lock_guard<std::mutex> l(mutex);
+		for (auto& block : blocks) {
+			if (block.memory == allocation.memory) {
+				blockSize = block.size;
+				memoryType = block.memoryType;
+				break;
+			}
+		}
+	}
+
+	if (!blockSize || (vulkanDevice->memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+		return;
+
+	// The range has to be in whole nonCoherentAtomSize units, or reach the end of the block
+	VkDeviceSize atom = vulkanDevice->properties.limits.nonCoherentAtomSize;
+	VkMappedMemoryRange mappedRange = vks::initializers::mappedMemoryRange();
+	mappedRange.memory = allocation.memory;
+	mappedRange.offset = allocation.offset / atom * atom;
+	mappedRange.size = alignUp(allocation.offset + allocation.size, atom) - mappedRange.offset;
+	if (mappedRange.offset + mappedRange.size >= blockSize)
+		mappedRange.size = VK_WHOLE_SIZE;
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->FlushMappedMemoryRanges(vulkanDevice->logicalDevice, 1, &mappedRange));
+}
+
+VkDeviceSize MemoryPool::footprint()
+{
+	std::lock_guard<std::mutex> l(mutex);
+	return footprintSize;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "vks/VulkanDevice.hpp"
+
+// Size of the blocks MemoryPool takes from the driver, bigger requests get a block of their own
+#define MEMORYPOOL_BLOCK_SIZE (1 << 20)
+
+// A range of a MemoryPool block, bound to one buffer or image
+struct MemoryAllocation
+{
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	void *mapped = nullptr;  // already at `offset`, host visible memory only
+};
+
+/*
+	Per device sub-allocator for the overlay's buffers and images, so a
+	swapchain does not cost a handful of vkAllocateMemory calls.
+
+	Blocks are handed out first fit and empty blocks go straight back to the
+	driver. Buffers and images never share a block, so only their own
+	alignment matters and not bufferImageGranularity. Host visible blocks are
+	mapped once for their whole lifetime, vkMapMemory can not map one
+	VkDeviceMemory twice.
+*/
+class MemoryPool
+{
+	struct Range {
+		VkDeviceSize offset, size;
+	};
+
+	struct Block {
+		VkDeviceMemory memory;
+		VkDeviceSize size;
+		VkDeviceSize used;
+		uint32_t memoryType;
+		bool image;
+		uint8_t *mapped;
+		std::vector<Range> free;  // sorted by offset, never adjacent
+	};
+
+	vks::VulkanDevice *vulkanDevice;
+	const VkAllocationCallbacks *allocator;
+	std::mutex mutex;
+	std::vector<Block> blocks;
+	VkDeviceSize footprintSize = 0;
+
+	MemoryAllocation allocate(const VkMemoryRequirements& memReqs, VkMemoryPropertyFlags properties, bool image);
+
+public:
+	MemoryPool(vks::VulkanDevice *vulkanDevice, const VkAllocationCallbacks *allocator = nullptr)
+		: vulkanDevice(vulkanDevice), allocator(allocator) {}
+	~MemoryPool();
+
+	// Allocate memory with `properties` and bind it, throws like VulkanDevice::getMemoryType
+	MemoryAllocation bindBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties);
+	MemoryAllocation bindImage(VkImage image, VkMemoryPropertyFlags properties);
+
+	// Return the range once the buffer or image bound to it is destroyed
+	void free(MemoryAllocation& allocation);
+
+	// Make host writes visible to the device, a no-op on coherent memory
+	void flush(const MemoryAllocation& allocation);
+
+	// Device memory currently taken from the driver, in bytes
+	VkDeviceSize footprint();
+};
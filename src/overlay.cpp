@@ -1,14 +1,22 @@
 #include <array>
 #include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "dispatch.hpp"
 #include "overlay.hpp"
 #include "vks/VulkanTools.h"
+#include "font_atlas.h"
 
 #define VERTEX_BUFFER_BIND_ID 0
 #define ENABLE_VALIDATION false
 
 // Max. number of chars the text overlay buffer can hold
-#define TEXTOVERLAY_MAX_CHAR_COUNT 2048u
+#define TEXTOVERLAY_MAX_CHAR_COUNT 4096u
 
 static const uint32_t overlay_vert_spv[] = {
 #include "overlay.vert.spv.h"
@@ -16,165 +24,281 @@ static const uint32_t overlay_vert_spv[] = {
 static const uint32_t overlay_frag_spv[] = {
 #include "overlay.frag.spv.h"
 };
+static const uint32_t overlay_pull_vert_spv[] = {
+#include "overlay_pull.vert.spv.h"
+};
+static const uint32_t composite_vert_spv[] = {
+#include "composite.vert.spv.h"
+};
+static const uint32_t composite_frag_spv[] = {
+#include "composite.frag.spv.h"
+};
+static const uint32_t composite_comp_spv[] = {
+#include "composite.comp.spv.h"
+};
+
+// Set on TextOverlay::published while the parked buffer is newer than what the reader has
+#define TEXTOVERLAY_FRESH 0x80000000u
+
+// Cache image dimensions are rounded up to this to avoid recreating it on every small change
+#define TEXTOVERLAY_CACHE_ALIGN 64u
+
+// Push constants for the composite quad
+struct CompositeRect
+{
+	glm::vec4 pos; // x0, y0, x1, y1 in NDC
+	glm::vec4 uv;  // s0, t0, s1, t1 in the cache image
+};
+
+// Push constants for the compute composite
+struct CompositeTile
+{
+	int32_t offset[2]; // in the swapchain image
+	int32_t extent[2];
+};
 
-VkPipelineShaderStageCreateInfo TextOverlay::loadShader(const uint32_t *shaderCode, const size_t size, VkShaderStageFlagBits stage)
+VkPipelineShaderStageCreateInfo OverlayShared::loadShader(const uint32_t *shaderCode, const size_t size, VkShaderStageFlagBits stage)
 {
 	VkPipelineShaderStageCreateInfo shaderStage = {};
 	shaderStage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	shaderStage.stage = stage;
-	shaderStage.module = vks::tools::loadShader(shaderCode, size, vulkanDevice->logicalDevice);
+	shaderStage.module = vks::tools::loadShader(shaderCode, size, vulkanDevice->logicalDevice, allocator);
 	shaderStage.pName = "main"; // todo : make param
 	assert(shaderStage.module != VK_NULL_HANDLE);
 	return shaderStage;
 }
 
-TextOverlay::TextOverlay(
-	vks::VulkanDevice *vulkanDevice,
-	VkQueue queue,
-	std::vector<VkFramebuffer> &framebuffers,
-	VkFormat colorformat,
-//	VkFormat depthformat,
-	uint32_t framebufferwidth,
-	uint32_t framebufferheight
-	/*, std::vector<VkPipelineShaderStageCreateInfo> shaderstages*/)
+OverlayShared::OverlayShared(vks::VulkanDevice *vulkanDevice, const VkAllocationCallbacks *allocator)
+	: memoryPool(vulkanDevice, allocator)
 {
 	this->vulkanDevice = vulkanDevice;
-	this->queue = queue;
-	this->colorFormat = colorformat;
-//	this->depthFormat = depthformat;
-
-	this->frameBuffers.resize(framebuffers.size());
-	for (uint32_t i = 0; i < framebuffers.size(); i++)
-	{
-		this->frameBuffers[i] = &framebuffers[i];
-	}
-
-	this->shaderStages.push_back(loadShader(overlay_vert_spv, sizeof(overlay_vert_spv), VK_SHADER_STAGE_VERTEX_BIT));
-	this->shaderStages.push_back(loadShader(overlay_frag_spv, sizeof(overlay_frag_spv), VK_SHADER_STAGE_FRAGMENT_BIT));
-
-	this->frameBufferWidth = framebufferwidth;
-	this->frameBufferHeight = framebufferheight;
+	this->allocator = allocator;
 
 	char *env = getenv("NUUDEL_RGBA");
 	int r,g,b,a, ret;
 	if (env && (ret = sscanf(env, "%d,%d,%d,%d", &r, &g, &b, &a)) >= 3)
 	{
-		fontColor[0] = r / 255.f;
-		fontColor[1] = g / 255.f;
-		fontColor[2] = b / 255.f;
+		palette[0][0] = r / 255.f;
+		palette[0][1] = g / 255.f;
+		palette[0][2] = b / 255.f;
 		if (ret == 4)
-			fontColor[3] = a / 255.f;
+			palette[0][3] = a / 255.f;
 	}
 
-	cmdBuffers.resize(framebuffers.size());
+	env = getenv("NUUDEL_OFFSCREEN");
+	if (env && sscanf(env, "%d", &ret) == 1)
+		cached = !!ret;
+
+	env = getenv("NUUDEL_VERTEX_PULLING");
+	if (env && sscanf(env, "%d", &ret) == 1)
+		pulling = !!ret;
+
+	const DeviceData& device_data = g_device_dispatch[GetKey(vulkanDevice->logicalDevice)];
+
+	// Reads and writes the swapchain image without knowing its format
+	if (computeRequested() && device_data.storage_without_format)
+		compute = cached = true;
+
+	dynamicRendering = device_data.dynamic_rendering;
+	cmdBeginRendering = device_data.CmdBeginRendering;
+	cmdEndRendering = device_data.CmdEndRendering;
+
+	// [0] text vertex, [1] text fragment, [2] [3] composite
+	if (pulling)
+		shaderStages.push_back(loadShader(overlay_pull_vert_spv, sizeof(overlay_pull_vert_spv), VK_SHADER_STAGE_VERTEX_BIT));
+	else
+		shaderStages.push_back(loadShader(overlay_vert_spv, sizeof(overlay_vert_spv), VK_SHADER_STAGE_VERTEX_BIT));
+	shaderStages.push_back(loadShader(overlay_frag_spv, sizeof(overlay_frag_spv), VK_SHADER_STAGE_FRAGMENT_BIT));
+	if (cached) {
+		shaderStages.push_back(loadShader(composite_vert_spv, sizeof(composite_vert_spv), VK_SHADER_STAGE_VERTEX_BIT));
+		shaderStages.push_back(loadShader(composite_frag_spv, sizeof(composite_frag_spv), VK_SHADER_STAGE_FRAGMENT_BIT));
+	}
+	// [4] compute composite
+	if (compute)
+		shaderStages.push_back(loadShader(composite_comp_spv, sizeof(composite_comp_spv), VK_SHADER_STAGE_COMPUTE_BIT));
+
 	prepareResources();
-	prepareRenderPass();
-	preparePipeline();
 }
 
-TextOverlay::~TextOverlay()
+bool OverlayShared::computeRequested()
 {
-	// Free up all Vulkan resources requested by the text overlay
-	for (auto& shaderStage : shaderStages)
-	{
-		vulkanDevice->getDispatch()->DestroyShaderModule(vulkanDevice->logicalDevice, shaderStage.module, nullptr);
-	}
-	vulkanDevice->getDispatch()->DestroySampler(vulkanDevice->logicalDevice, sampler, nullptr);
-	vulkanDevice->getDispatch()->DestroyImage(vulkanDevice->logicalDevice, image, nullptr);
-	vulkanDevice->getDispatch()->DestroyImageView(vulkanDevice->logicalDevice, view, nullptr);
-	vulkanDevice->getDispatch()->DestroyBuffer(vulkanDevice->logicalDevice, buffer[0], nullptr);
-	vulkanDevice->getDispatch()->DestroyBuffer(vulkanDevice->logicalDevice, buffer[1], nullptr);
-	vulkanDevice->getDispatch()->DestroyBuffer(vulkanDevice->logicalDevice, uniformBuffer.buffer, nullptr);
-	vulkanDevice->getDispatch()->FreeMemory(vulkanDevice->logicalDevice, memory[0], nullptr);
-	vulkanDevice->getDispatch()->FreeMemory(vulkanDevice->logicalDevice, memory[1], nullptr);
-	vulkanDevice->getDispatch()->FreeMemory(vulkanDevice->logicalDevice, imageMemory, nullptr);
-	vulkanDevice->getDispatch()->FreeMemory(vulkanDevice->logicalDevice, uniformBuffer.memory, nullptr);
-	vulkanDevice->getDispatch()->DestroyDescriptorSetLayout(vulkanDevice->logicalDevice, descriptorSetLayout, nullptr);
-	vulkanDevice->getDispatch()->DestroyDescriptorPool(vulkanDevice->logicalDevice, descriptorPool, nullptr);
-	vulkanDevice->getDispatch()->DestroyPipelineLayout(vulkanDevice->logicalDevice, pipelineLayout, nullptr);
-	vulkanDevice->getDispatch()->DestroyPipelineCache(vulkanDevice->logicalDevice, pipelineCache, nullptr);
-	vulkanDevice->getDispatch()->DestroyPipeline(vulkanDevice->logicalDevice, pipeline, nullptr);
-	vulkanDevice->getDispatch()->DestroyRenderPass(vulkanDevice->logicalDevice, renderPass, nullptr);
-	vulkanDevice->getDispatch()->DestroyCommandPool(vulkanDevice->logicalDevice, commandPool, nullptr);
+	int ret;
+	char *env = getenv("NUUDEL_COMPUTE");
+	return env && sscanf(env, "%d", &ret) == 1 && ret;
 }
 
-// Prepare all vulkan resources required to render the font
-// The text overlay uses separate resources for descriptors (pool, sets, layouts), pipelines and command buffers
-void TextOverlay::prepareResources()
+OverlayShared::~OverlayShared()
 {
-	uint8_t *data;
-	const uint32_t fontWidth = STB_FONT_consolas_bold_24_latin1_BITMAP_WIDTH;
-	const uint32_t fontHeight = STB_FONT_consolas_bold_24_latin1_BITMAP_WIDTH;
+	for (auto& it : pipelines)
+	{
+		vulkanDevice->getDispatch()->DestroyPipeline(vulkanDevice->logicalDevice, it.second.pipeline, allocator);
+		vulkanDevice->getDispatch()->DestroyPipeline(vulkanDevice->logicalDevice, it.second.compositePipeline, allocator);
+		vulkanDevice->getDispatch()->DestroyRenderPass(vulkanDevice->logicalDevice, it.second.renderPass, allocator);
+	}
+	for (auto& shaderStage : shaderStages)
+	{
+		vulkanDevice->getDispatch()->DestroyShaderModule(vulkanDevice->logicalDevice, shaderStage.module, allocator);
+	}
+	vulkanDevice->getDispatch()->DestroySampler(vulkanDevice->logicalDevice, sampler, allocator);
+	vulkanDevice->getDispatch()->DestroyImage(vulkanDevice->logicalDevice, image, allocator);
+	vulkanDevice->getDispatch()->DestroyImageView(vulkanDevice->logicalDevice, view, allocator);
+	vulkanDevice->getDispatch()->DestroyBuffer(vulkanDevice->logicalDevice, uniformBuffer.buffer, allocator);
+	memoryPool.free(imageMemory);
+	memoryPool.free(uniformBuffer.memory);
+
+	if (pulling) {
+		vulkanDevice->getDispatch()->DestroyBuffer(vulkanDevice->logicalDevice, metricsBuffer.buffer, allocator);
+		memoryPool.free(metricsBuffer.memory);
+		vulkanDevice->getDispatch()->DestroyDescriptorSetLayout(vulkanDevice->logicalDevice, glyphSetLayout, allocator);
+	}
+	vulkanDevice->getDispatch()->DestroyDescriptorSetLayout(vulkanDevice->logicalDevice, descriptorSetLayout, allocator);
+	vulkanDevice->getDispatch()->DestroyDescriptorPool(vulkanDevice->logicalDevice, descriptorPool, allocator);
+	vulkanDevice->getDispatch()->DestroyPipelineLayout(vulkanDevice->logicalDevice, pipelineLayout, allocator);
+	vulkanDevice->getDispatch()->DestroyCommandPool(vulkanDevice->logicalDevice, upload.commandPool, allocator);
+	vulkanDevice->getDispatch()->DestroyBuffer(vulkanDevice->logicalDevice, upload.stagingBuffer, allocator);
+	memoryPool.free(upload.stagingMemory);
+
+	savePipelineCache();
+	vulkanDevice->getDispatch()->DestroyPipelineCache(vulkanDevice->logicalDevice, pipelineCache, allocator);
+
+	if (cached) {
+		vulkanDevice->getDispatch()->DestroyPipeline(vulkanDevice->logicalDevice, cachePipeline, allocator);
+		vulkanDevice->getDispatch()->DestroyPipelineLayout(vulkanDevice->logicalDevice, compositePipelineLayout, allocator);
+		vulkanDevice->getDispatch()->DestroyDescriptorSetLayout(vulkanDevice->logicalDevice, compositeSetLayout, allocator);
+		vulkanDevice->getDispatch()->DestroyRenderPass(vulkanDevice->logicalDevice, cacheRenderPass, allocator);
+	}
 
-	static unsigned char font24pixels[fontWidth][fontHeight];
-	stb_font_consolas_bold_24_latin1(stbFontData, font24pixels, fontHeight);
+	if (compute) {
+		vulkanDevice->getDispatch()->DestroyPipeline(vulkanDevice->logicalDevice, computePipeline, allocator);
+		vulkanDevice->getDispatch()->DestroyPipelineLayout(vulkanDevice->logicalDevice, computePipelineLayout, allocator);
+		vulkanDevice->getDispatch()->DestroyDescriptorSetLayout(vulkanDevice->logicalDevice, computeSetLayout, allocator);
+	}
+}
 
-	// Command buffer
+// One instance per glyph, the quad corners come from gl_VertexIndex
+static const VkVertexInputBindingDescription glyphBindings[] = {
+	{ VERTEX_BUFFER_BIND_ID, sizeof(GlyphInstance), VK_VERTEX_INPUT_RATE_INSTANCE },
+};
+static constexpr VkVertexInputAttributeDescription glyphAttributes[] = {
+	{ 0, VERTEX_BUFFER_BIND_ID, VK_FORMAT_R16G16B16A16_SNORM, offsetof(GlyphInstance, pos) },	// Location 0: Position rect
+	{ 1, VERTEX_BUFFER_BIND_ID, VK_FORMAT_R16G16B16A16_UNORM, offsetof(GlyphInstance, uv) },	// Location 1: UV rect
+	{ 2, VERTEX_BUFFER_BIND_ID, VK_FORMAT_R32_UINT, offsetof(GlyphInstance, color) },		// Location 2: Palette index
+};
 
-	// Pool
-	VkCommandPoolCreateInfo cmdPoolInfo = {};
-	cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	cmdPoolInfo.queueFamilyIndex = vulkanDevice->queueFamilyIndices.graphics;
-	cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateCommandPool(vulkanDevice->logicalDevice, &cmdPoolInfo, nullptr, &commandPool));
+// Byte size of the vertex formats used above
+static constexpr uint32_t vertexFormatSize(VkFormat format)
+{
+	switch (format) {
+	case VK_FORMAT_R16G16B16A16_SNORM:
+	case VK_FORMAT_R16G16B16A16_UNORM:
+		return 8;
+	case VK_FORMAT_R32_UINT:
+		return 4;
+	default:
+		return 0;
+	}
+}
 
-	VkCommandBufferAllocateInfo cmdBufAllocateInfo =
-		vks::initializers::commandBufferAllocateInfo(
-			commandPool,
-			VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-			(uint32_t)cmdBuffers.size());
+// Keep GlyphInstance and the attributes from drifting apart
+static_assert(vertexFormatSize(glyphAttributes[0].format) == sizeof(GlyphInstance::pos), "pos does not match its vertex format");
+static_assert(vertexFormatSize(glyphAttributes[1].format) == sizeof(GlyphInstance::uv), "uv does not match its vertex format");
+static_assert(vertexFormatSize(glyphAttributes[2].format) == sizeof(GlyphInstance::color), "color does not match its vertex format");
+static_assert(glyphAttributes[2].offset + vertexFormatSize(glyphAttributes[2].format) == sizeof(GlyphInstance), "attributes do not cover GlyphInstance");
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateCommandBuffers(vulkanDevice->logicalDevice, &cmdBufAllocateInfo, cmdBuffers.data()));
+static inline int16_t packSnorm16(float v)
+{
+	return (int16_t)roundf(std::min(std::max(v, -1.0f), 1.0f) * 32767.0f);
+}
 
-	const DeviceData *device_data = &g_device_dispatch[GetKey(vulkanDevice->logicalDevice)];
-	for (uint32_t i = 0; i < cmdBuffers.size(); ++i)
-		device_data->set_device_loader_data(vulkanDevice->logicalDevice, cmdBuffers[i]);
+static inline uint16_t packUnorm16(float v)
+{
+	return (uint16_t)roundf(std::min(std::max(v, 0.0f), 1.0f) * 65535.0f);
+}
 
-	// Vertex buffer
-	VkDeviceSize bufferSize = TEXTOVERLAY_MAX_CHAR_COUNT * sizeof(Vertex);
+// Clip a glyph quad to the screen and move its UVs with the corners, so a
+// glyph crossing the edge is cut off instead of squashed into the packed
+// SNORM16 range. False if none of it is on screen
+static bool clipGlyph(glm::vec4& pos, glm::vec4& uv)
+{
+	glm::vec4 clipped = glm::clamp(pos, -1.0f, 1.0f);
+	if (clipped.x >= clipped.z || clipped.y >= clipped.w)
+		return false;
+
+	glm::vec2 size(pos.z - pos.x, pos.w - pos.y);
+	glm::vec4 t((clipped.x - pos.x) / size.x, (clipped.y - pos.y) / size.y,
+		(clipped.z - pos.x) / size.x, (clipped.w - pos.y) / size.y);
+	uv = glm::vec4(glm::mix(uv.x, uv.z, t.x), glm::mix(uv.y, uv.w, t.y),
+		glm::mix(uv.x, uv.z, t.z), glm::mix(uv.y, uv.w, t.w));
+	pos = clipped;
+	return true;
+}
 
-	VkBufferCreateInfo bufferInfo = vks::initializers::bufferCreateInfo(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, bufferSize);
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateBuffer(vulkanDevice->logicalDevice, &bufferInfo, nullptr, &buffer[0]));
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateBuffer(vulkanDevice->logicalDevice, &bufferInfo, nullptr, &buffer[1]));
+// GlyphRecord pen position, in quarter pixels
+static inline int16_t packQuarterPixel(float v)
+{
+	return (int16_t)roundf(std::min(std::max(v * 4.0f, -32768.0f), 32767.0f));
+}
 
-	VkMemoryRequirements memReqs;
-	VkMemoryAllocateInfo allocInfo = vks::initializers::memoryAllocateInfo();
+static VkPipelineVertexInputStateCreateInfo glyphInputState()
+{
+	VkPipelineVertexInputStateCreateInfo vertexInputState = vks::initializers::pipelineVertexInputStateCreateInfo();
+	vertexInputState.vertexBindingDescriptionCount = 1;
+	vertexInputState.pVertexBindingDescriptions = glyphBindings;
+	vertexInputState.vertexAttributeDescriptionCount = 3;
+	vertexInputState.pVertexAttributeDescriptions = glyphAttributes;
+	return vertexInputState;
+}
 
-	vulkanDevice->getDispatch()->GetBufferMemoryRequirements(vulkanDevice->logicalDevice, buffer[0], &memReqs);
-	allocInfo.allocationSize = memReqs.size;
-	allocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+// Enable blending, using alpha from red channel of the font texture (see text.frag)
+static VkPipelineColorBlendAttachmentState textBlendState()
+{
+	VkPipelineColorBlendAttachmentState blendAttachmentState{};
+	blendAttachmentState.blendEnable = VK_TRUE;
+	blendAttachmentState.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+	blendAttachmentState.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+	blendAttachmentState.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+	blendAttachmentState.colorBlendOp = VK_BLEND_OP_ADD;
+	blendAttachmentState.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+	blendAttachmentState.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+	blendAttachmentState.alphaBlendOp = VK_BLEND_OP_ADD;
+	return blendAttachmentState;
+}
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateMemory(vulkanDevice->logicalDevice, &allocInfo, nullptr, &memory[0]));
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->BindBufferMemory(vulkanDevice->logicalDevice, buffer[0], memory[0], 0));
+// Prepare all vulkan resources required to render the font
+// The text overlay uses separate resources for descriptors (pool, sets, layouts), pipelines and command buffers
+void OverlayShared::prepareResources()
+{
+	// Baked at build time, see font_bake.cpp
+	const uint32_t fontWidth = font_atlas_width;
+	const uint32_t fontHeight = font_atlas_height;
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateMemory(vulkanDevice->logicalDevice, &allocInfo, nullptr, &memory[1]));
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->BindBufferMemory(vulkanDevice->logicalDevice, buffer[1], memory[1], 0));
+	const DeviceData *device_data = &g_device_dispatch[GetKey(vulkanDevice->logicalDevice)];
 
-	// Uniform buffer for color
-	bufferSize = sizeof(glm::vec4);
-	bufferInfo = vks::initializers::bufferCreateInfo(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, bufferSize);
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateBuffer(vulkanDevice->logicalDevice, &bufferInfo, nullptr, &uniformBuffer.buffer));
+	// Only needed for the atlas upload
+	VkCommandPoolCreateInfo cmdPoolInfo = {};
+	cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	cmdPoolInfo.queueFamilyIndex = vulkanDevice->queueFamilyIndices.graphics;
+	cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateCommandPool(vulkanDevice->logicalDevice, &cmdPoolInfo, allocator, &upload.commandPool));
 
-	allocInfo = vks::initializers::memoryAllocateInfo();
-	vulkanDevice->getDispatch()->GetBufferMemoryRequirements(vulkanDevice->logicalDevice, uniformBuffer.buffer, &memReqs);
-	allocInfo.allocationSize = memReqs.size;
-	allocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	VkCommandBufferAllocateInfo cmdBufAllocateInfo =
+		vks::initializers::commandBufferAllocateInfo(
+			upload.commandPool,
+			VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			1);
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateMemory(vulkanDevice->logicalDevice, &allocInfo, nullptr, &uniformBuffer.memory));
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->BindBufferMemory(vulkanDevice->logicalDevice, uniformBuffer.buffer, uniformBuffer.memory, 0));
+	// Uniform buffer for the color palette
+	VkDeviceSize bufferSize = sizeof(palette);
+	VkBufferCreateInfo bufferInfo = vks::initializers::bufferCreateInfo(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, bufferSize);
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateBuffer(vulkanDevice->logicalDevice, &bufferInfo, allocator, &uniformBuffer.buffer));
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->MapMemory(vulkanDevice->logicalDevice, uniformBuffer.memory, 0, allocInfo.allocationSize, 0, (void **)&data));
-	VkMappedMemoryRange mappedRange = vks::initializers::mappedMemoryRange();
-	mappedRange.memory = uniformBuffer.memory;
-	mappedRange.offset = 0;
-	mappedRange.size = allocInfo.allocationSize;
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->InvalidateMappedMemoryRanges(vulkanDevice->logicalDevice, 1, &mappedRange));
-	memcpy(data, &fontColor, sizeof(glm::vec4));
-	vulkanDevice->getDispatch()->UnmapMemory(vulkanDevice->logicalDevice, uniformBuffer.memory);
+	uniformBuffer.memory = memoryPool.bindBuffer(uniformBuffer.buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	memcpy(uniformBuffer.memory.mapped, palette, sizeof(palette));
+	memoryPool.flush(uniformBuffer.memory);
 
 	uniformBuffer.descriptor.buffer = uniformBuffer.buffer;
 	uniformBuffer.descriptor.offset = 0;
-	uniformBuffer.descriptor.range = allocInfo.allocationSize;
+	uniformBuffer.descriptor.range = bufferSize;
 
 	// Font texture
 	VkImageCreateInfo imageInfo = vks::initializers::imageCreateInfo();
@@ -191,47 +315,26 @@ void TextOverlay::prepareResources()
 	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateImage(vulkanDevice->logicalDevice, &imageInfo, nullptr, &image));
-
-	vulkanDevice->getDispatch()->GetImageMemoryRequirements(vulkanDevice->logicalDevice, image, &memReqs);
-	allocInfo.allocationSize = memReqs.size;
-	allocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateImage(vulkanDevice->logicalDevice, &imageInfo, allocator, &image));
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateMemory(vulkanDevice->logicalDevice, &allocInfo, nullptr, &imageMemory));
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->BindImageMemory(vulkanDevice->logicalDevice, image, imageMemory, 0));
+	imageMemory = memoryPool.bindImage(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
 	// Staging
 
-	struct {
-		VkDeviceMemory memory;
-		VkBuffer buffer;
-	} stagingBuffer;
-
 	VkBufferCreateInfo bufferCreateInfo = vks::initializers::bufferCreateInfo();
-	bufferCreateInfo.size = allocInfo.allocationSize;
+	bufferCreateInfo.size = fontWidth * fontHeight;
 	bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
 	bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateBuffer(vulkanDevice->logicalDevice, &bufferCreateInfo, nullptr, &stagingBuffer.buffer));
-
-	// Get memory requirements for the staging buffer (alignment, memory type bits)
-	vulkanDevice->getDispatch()->GetBufferMemoryRequirements(vulkanDevice->logicalDevice, stagingBuffer.buffer, &memReqs);
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateBuffer(vulkanDevice->logicalDevice, &bufferCreateInfo, allocator, &upload.stagingBuffer));
 
-	allocInfo.allocationSize = memReqs.size;
-	// Get memory type index for a host visible buffer
-	allocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateMemory(vulkanDevice->logicalDevice, &allocInfo, nullptr, &stagingBuffer.memory));
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->BindBufferMemory(vulkanDevice->logicalDevice, stagingBuffer.buffer, stagingBuffer.memory, 0));
-
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->MapMemory(vulkanDevice->logicalDevice, stagingBuffer.memory, 0, allocInfo.allocationSize, 0, (void **)&data));
+	upload.stagingMemory = memoryPool.bindBuffer(upload.stagingBuffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
 	// Size of the font texture is WIDTH * HEIGHT * 1 byte (only one channel)
-	memcpy(data, &font24pixels[0][0], fontWidth * fontHeight);
-	vulkanDevice->getDispatch()->UnmapMemory(vulkanDevice->logicalDevice, stagingBuffer.memory);
+	memcpy(upload.stagingMemory.mapped, font_atlas_pixels, sizeof(font_atlas_pixels));
 
 	// Copy to image
 
-	VkCommandBuffer copyCmd;
+	VkCommandBuffer& copyCmd = upload.cmdBuffer;
 	cmdBufAllocateInfo.commandBufferCount = 1;
 	VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateCommandBuffers(vulkanDevice->logicalDevice, &cmdBufAllocateInfo, &copyCmd));
 
@@ -259,7 +362,7 @@ void TextOverlay::prepareResources()
 
 	vulkanDevice->getDispatch()->CmdCopyBufferToImage(
 		copyCmd,
-		stagingBuffer.buffer,
+		upload.stagingBuffer,
 		image,
 		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 		1,
@@ -277,16 +380,9 @@ void TextOverlay::prepareResources()
 
 	VK_CHECK_RESULT(vulkanDevice->getDispatch()->EndCommandBuffer(copyCmd));
 
-	VkSubmitInfo submitInfo = vks::initializers::submitInfo();
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &copyCmd;
-
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->QueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->QueueWaitIdle(queue));
-
-	vulkanDevice->getDispatch()->FreeCommandBuffers(vulkanDevice->logicalDevice, commandPool, 1, &copyCmd);
-	vulkanDevice->getDispatch()->FreeMemory(vulkanDevice->logicalDevice, stagingBuffer.memory, nullptr);
-	vulkanDevice->getDispatch()->DestroyBuffer(vulkanDevice->logicalDevice, stagingBuffer.buffer, nullptr);
+	// Goes out with the first overlay submit, this may run on a thread that
+	// must not touch the application's queue
+	upload.pending = true;
 
 	VkImageViewCreateInfo imageViewInfo = vks::initializers::imageViewCreateInfo();
 	imageViewInfo.image = image;
@@ -294,7 +390,7 @@ void TextOverlay::prepareResources()
 	imageViewInfo.format = imageInfo.format;
 	imageViewInfo.components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_B,	VK_COMPONENT_SWIZZLE_A };
 	imageViewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateImageView(vulkanDevice->logicalDevice, &imageViewInfo, nullptr, &view));
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateImageView(vulkanDevice->logicalDevice, &imageViewInfo, allocator, &view));
 
 	// Sampler
 	VkSamplerCreateInfo samplerInfo = vks::initializers::samplerCreateInfo();
@@ -310,13 +406,37 @@ void TextOverlay::prepareResources()
 	samplerInfo.maxLod = 1.0f;
 	samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
 	samplerInfo.compareEnable = VK_FALSE;
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateSampler(vulkanDevice->logicalDevice, &samplerInfo, nullptr, &sampler));
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateSampler(vulkanDevice->logicalDevice, &samplerInfo, allocator, &sampler));
+
+	if (pulling) {
+		// Glyph metrics for overlay_pull.vert, in the same units addText uses
+		std::vector<GlyphMetric> metrics(font_atlas_num_chars);
+		for (size_t i = 0; i < metrics.size(); i++) {
+			const stb_fontchar& c = font_atlas_chars[i];
+			metrics[i].rect = glm::vec4(c.x0, c.y0, c.x1, c.y1);
+			metrics[i].uv = glm::vec4(c.s0, c.t0, c.s1, c.t1);
+		}
+
+		VkDeviceSize metricsSize = metrics.size() * sizeof(GlyphMetric);
+		VkBufferCreateInfo metricsInfo = vks::initializers::bufferCreateInfo(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, metricsSize);
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateBuffer(vulkanDevice->logicalDevice, &metricsInfo, allocator, &metricsBuffer.buffer));
+
+		metricsBuffer.memory = memoryPool.bindBuffer(metricsBuffer.buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		memcpy(metricsBuffer.memory.mapped, metrics.data(), metricsSize);
+
+		metricsBuffer.descriptor.buffer = metricsBuffer.buffer;
+		metricsBuffer.descriptor.offset = 0;
+		metricsBuffer.descriptor.range = metricsSize;
+	}
 
 	// Descriptor
 	// Font uses a separate descriptor pool
-	std::array<VkDescriptorPoolSize, 2> poolSizes;
-	poolSizes[0] = vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1);
-	poolSizes[1] = vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1);
+	std::vector<VkDescriptorPoolSize> poolSizes = {
+		vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1),
+		vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1),
+	};
+	if (pulling)
+		poolSizes.push_back(vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1));
 
 	VkDescriptorPoolCreateInfo descriptorPoolInfo =
 		vks::initializers::descriptorPoolCreateInfo(
@@ -324,18 +444,21 @@ void TextOverlay::prepareResources()
 			poolSizes.data(),
 			1);
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateDescriptorPool(vulkanDevice->logicalDevice, &descriptorPoolInfo, nullptr, &descriptorPool));
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateDescriptorPool(vulkanDevice->logicalDevice, &descriptorPoolInfo, allocator, &descriptorPool));
 
 	// Descriptor set layout
-	std::array<VkDescriptorSetLayoutBinding, 2> setLayoutBindings;
-	setLayoutBindings[0] = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 0);
-	setLayoutBindings[1] = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 1);
+	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
+		vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 0),
+		vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 1),
+	};
+	if (pulling)
+		setLayoutBindings.push_back(vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 2));
 
 	VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo =
 		vks::initializers::descriptorSetLayoutCreateInfo(
 			setLayoutBindings.data(),
 			static_cast<uint32_t>(setLayoutBindings.size()));
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateDescriptorSetLayout(vulkanDevice->logicalDevice, &descriptorSetLayoutInfo, nullptr, &descriptorSetLayout));
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateDescriptorSetLayout(vulkanDevice->logicalDevice, &descriptorSetLayoutInfo, allocator, &descriptorSetLayout));
 
 	// Pipeline layout
 	VkPipelineLayoutCreateInfo pipelineLayoutInfo =
@@ -343,7 +466,24 @@ void TextOverlay::prepareResources()
 			&descriptorSetLayout,
 			1);
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreatePipelineLayout(vulkanDevice->logicalDevice, &pipelineLayoutInfo, nullptr, &pipelineLayout));
+	// Vertex pulling: set 1 is the glyph record buffer of each TextOverlay,
+	// push constants carry the framebuffer size
+	VkDescriptorSetLayout pullSetLayouts[2];
+	VkPushConstantRange fbSizeRange = vks::initializers::pushConstantRange(VK_SHADER_STAGE_VERTEX_BIT, sizeof(glm::vec2), 0);
+	if (pulling) {
+		VkDescriptorSetLayoutBinding glyphBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0);
+		VkDescriptorSetLayoutCreateInfo glyphLayoutInfo = vks::initializers::descriptorSetLayoutCreateInfo(&glyphBinding, 1);
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateDescriptorSetLayout(vulkanDevice->logicalDevice, &glyphLayoutInfo, allocator, &glyphSetLayout));
+
+		pullSetLayouts[0] = descriptorSetLayout;
+		pullSetLayouts[1] = glyphSetLayout;
+		pipelineLayoutInfo.setLayoutCount = 2;
+		pipelineLayoutInfo.pSetLayouts = pullSetLayouts;
+		pipelineLayoutInfo.pushConstantRangeCount = 1;
+		pipelineLayoutInfo.pPushConstantRanges = &fbSizeRange;
+	}
+
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreatePipelineLayout(vulkanDevice->logicalDevice, &pipelineLayoutInfo, allocator, &pipelineLayout));
 
 	// Descriptor set
 	VkDescriptorSetAllocateInfo descriptorSetAllocInfo =
@@ -360,31 +500,174 @@ void TextOverlay::prepareResources()
 			view,
 			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL /*VK_IMAGE_LAYOUT_GENERAL*/); // validation wants VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
 
-	std::array<VkWriteDescriptorSet, 2> writeDescriptorSets;
-	writeDescriptorSets[0] = vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 0, &texDescriptor);
-	writeDescriptorSets[1] = vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, &uniformBuffer.descriptor);
+	std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 0, &texDescriptor),
+		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, &uniformBuffer.descriptor),
+	};
+	if (pulling)
+		writeDescriptorSets.push_back(vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2, &metricsBuffer.descriptor));
 	vulkanDevice->getDispatch()->UpdateDescriptorSets(vulkanDevice->logicalDevice, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, NULL);
 
+	if (cached) {
+		VkDescriptorSetLayoutBinding compositeBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			compute ? VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT : VK_SHADER_STAGE_FRAGMENT_BIT, 0);
+		VkDescriptorSetLayoutCreateInfo compositeLayoutInfo = vks::initializers::descriptorSetLayoutCreateInfo(&compositeBinding, 1);
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateDescriptorSetLayout(vulkanDevice->logicalDevice, &compositeLayoutInfo, allocator, &compositeSetLayout));
+
+		VkPushConstantRange pushConstantRange = vks::initializers::pushConstantRange(VK_SHADER_STAGE_VERTEX_BIT, sizeof(CompositeRect), 0);
+		VkPipelineLayoutCreateInfo compositePipelineLayoutInfo = vks::initializers::pipelineLayoutCreateInfo(&compositeSetLayout, 1);
+		compositePipelineLayoutInfo.pushConstantRangeCount = 1;
+		compositePipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreatePipelineLayout(vulkanDevice->logicalDevice, &compositePipelineLayoutInfo, allocator, &compositePipelineLayout));
+	}
+
+	if (compute) {
+		VkDescriptorSetLayoutBinding storageBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 0);
+		VkDescriptorSetLayoutCreateInfo storageLayoutInfo = vks::initializers::descriptorSetLayoutCreateInfo(&storageBinding, 1);
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateDescriptorSetLayout(vulkanDevice->logicalDevice, &storageLayoutInfo, allocator, &computeSetLayout));
+
+		VkDescriptorSetLayout computeSetLayouts[] = { compositeSetLayout, computeSetLayout };
+		VkPushConstantRange pushConstantRange = vks::initializers::pushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, sizeof(CompositeTile), 0);
+		VkPipelineLayoutCreateInfo computePipelineLayoutInfo = vks::initializers::pipelineLayoutCreateInfo(computeSetLayouts, 2);
+		computePipelineLayoutInfo.pushConstantRangeCount = 1;
+		computePipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreatePipelineLayout(vulkanDevice->logicalDevice, &computePipelineLayoutInfo, allocator, &computePipelineLayout));
+	}
+
 	// Pipeline cache
+	loadPipelineCache();
+
+	if (cached) {
+		// Text into the cache image, keep premultiplied alpha for compositing
+		VkPipelineVertexInputStateCreateInfo vertexInputState = pulling ? vks::initializers::pipelineVertexInputStateCreateInfo() : glyphInputState();
+		VkPipelineColorBlendAttachmentState blendAttachmentState = textBlendState();
+		blendAttachmentState.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+		blendAttachmentState.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+
+		if (!dynamicRendering)
+			cacheRenderPass = createRenderPass(VK_FORMAT_R8G8B8A8_UNORM, true);
+		cachePipeline = createPipeline(cacheRenderPass, VK_FORMAT_R8G8B8A8_UNORM, pipelineLayout, &shaderStages[0], vertexInputState, blendAttachmentState);
+	}
+
+	if (compute) {
+		VkComputePipelineCreateInfo computePipelineInfo = vks::initializers::computePipelineCreateInfo(computePipelineLayout, 0);
+		computePipelineInfo.stage = shaderStages[4];
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateComputePipelines(vulkanDevice->logicalDevice, pipelineCache, 1, &computePipelineInfo, allocator, &computePipeline));
+	}
+}
+
+// Create the pipeline cache, seeded from disk if there is a usable file
+void OverlayShared::loadPipelineCache()
+{
+	const VkPhysicalDeviceProperties& props = vulkanDevice->properties;
+	std::string dir;
+	const char *env = getenv("XDG_CACHE_HOME");
+	if (env && *env)
+		dir = env;
+	else if ((env = getenv("HOME")) && *env)
+		dir = std::string(env) + "/.cache";
+
+	if (!dir.empty()) {
+		// ignore errors, probably exists already
+		mkdir(dir.c_str(), 0755);
+		dir += "/nuudel";
+		mkdir(dir.c_str(), 0755);
+
+		char name[64];
+		int len = snprintf(name, sizeof(name), "/pipelines-%04x-%04x-", props.vendorID, props.deviceID);
+		for (uint32_t i = 0; i < VK_UUID_SIZE; i++)
+			len += snprintf(name + len, sizeof(name) - len, "%02x", props.pipelineCacheUUID[i]);
+		pipelineCachePath = dir + name + ".bin";
+	}
+
+	std::vector<char> blob;
+	if (!pipelineCachePath.empty()) {
+		std::ifstream file(pipelineCachePath, std::ios::binary);
+		if (file)
+			blob.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+
+	// Drivers should reject stale data themselves, but not all of them do it gracefully
+	struct {
+		uint32_t headerSize;
+		uint32_t headerVersion;
+		uint32_t vendorID;
+		uint32_t deviceID;
+		uint8_t uuid[VK_UUID_SIZE];
+	} header;
+
+	if (blob.size() >= sizeof(header)) {
+		memcpy(&header, blob.data(), sizeof(header));
+		pipelineCacheHit = header.headerSize >= sizeof(header)
+			&& header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+			&& header.vendorID == props.vendorID
+			&& header.deviceID == props.deviceID
+			&& !memcmp(header.uuid, props.pipelineCacheUUID, VK_UUID_SIZE);
+	}
+
 	VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {};
 	pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreatePipelineCache(vulkanDevice->logicalDevice, &pipelineCacheCreateInfo, nullptr, &pipelineCache));
+	if (pipelineCacheHit) {
+		pipelineCacheCreateInfo.initialDataSize = blob.size();
+		pipelineCacheCreateInfo.pInitialData = blob.data();
+		pipelineCacheSize = blob.size();
+	}
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreatePipelineCache(vulkanDevice->logicalDevice, &pipelineCacheCreateInfo, allocator, &pipelineCache));
+
+	std::cerr << "Pipeline cache " << (pipelineCacheHit ? "hit: " : "miss: ")
+		<< (pipelineCachePath.empty() ? "no cache directory" : pipelineCachePath) << std::endl;
 }
 
-// Prepare a separate pipeline for the font rendering decoupled from the main application
-void TextOverlay::preparePipeline()
+// Write the pipeline cache to a temporary file and rename it over the old
+// one, so a crash or a second process never leaves a torn file behind
+void OverlayShared::savePipelineCache()
 {
-	// Enable blending, using alpha from red channel of the font texture (see text.frag)
-	VkPipelineColorBlendAttachmentState blendAttachmentState{};
-	blendAttachmentState.blendEnable = VK_TRUE;
-	blendAttachmentState.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-	blendAttachmentState.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-	blendAttachmentState.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-	blendAttachmentState.colorBlendOp = VK_BLEND_OP_ADD;
-	blendAttachmentState.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-	blendAttachmentState.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-	blendAttachmentState.alphaBlendOp = VK_BLEND_OP_ADD;
+	if (pipelineCachePath.empty())
+		return;
+
+	size_t size = 0;
+	if (vulkanDevice->getDispatch()->GetPipelineCacheData(vulkanDevice->logicalDevice, pipelineCache, &size, nullptr) != VK_SUCCESS)
+		return;
+
+	// Nothing new since it was loaded
+	if (size == pipelineCacheSize)
+		return;
 
+	std::vector<char> blob(size);
+	if (vulkanDevice->getDispatch()->GetPipelineCacheData(vulkanDevice->logicalDevice, pipelineCache, &size, blob.data()) != VK_SUCCESS)
+		return;
+
+	// Unique per call, other devices in this process may be saving to the same path
+	std::string tmp = pipelineCachePath + ".XXXXXX";
+	int fd = mkostemp(&tmp[0], O_CLOEXEC);
+	if (fd < 0) {
+		perror("pipeline cache");
+		return;
+	}
+	FILE *file = fdopen(fd, "wb");
+	if (!file) {
+		perror("pipeline cache");
+		close(fd);
+		unlink(tmp.c_str());
+		return;
+	}
+
+	bool ok = fwrite(blob.data(), 1, size, file) == size;
+	ok = (fclose(file) == 0) && ok;
+	if (!ok || rename(tmp.c_str(), pipelineCachePath.c_str())) {
+		perror("pipeline cache");
+		unlink(tmp.c_str());
+		return;
+	}
+	pipelineCacheSize = size;
+}
+
+// Create a pipeline with the state shared by text and composite drawing
+VkPipeline OverlayShared::createPipeline(VkRenderPass pass, VkFormat format, VkPipelineLayout layout,
+	const VkPipelineShaderStageCreateInfo *stages,
+	const VkPipelineVertexInputStateCreateInfo& vertexInputState,
+	const VkPipelineColorBlendAttachmentState& blendAttachmentState)
+{
 	VkPipelineInputAssemblyStateCreateInfo inputAssemblyState = vks::initializers::pipelineInputAssemblyStateCreateInfo(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP, 0, VK_FALSE);
 	VkPipelineRasterizationStateCreateInfo rasterizationState = vks::initializers::pipelineRasterizationStateCreateInfo(VK_POLYGON_MODE_FILL, VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_CLOCKWISE, 0);
 	VkPipelineColorBlendStateCreateInfo colorBlendState = vks::initializers::pipelineColorBlendStateCreateInfo(1, &blendAttachmentState);
@@ -394,24 +677,7 @@ void TextOverlay::preparePipeline()
 	std::vector<VkDynamicState> dynamicStateEnables = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
 	VkPipelineDynamicStateCreateInfo dynamicState = vks::initializers::pipelineDynamicStateCreateInfo(dynamicStateEnables);
 
-	std::array<VkVertexInputBindingDescription, 3> vertexInputBindings = {
-		vks::initializers::vertexInputBindingDescription(0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX),
-		vks::initializers::vertexInputBindingDescription(1, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX),
-		vks::initializers::vertexInputBindingDescription(2, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX),
-	};
-	std::array<VkVertexInputAttributeDescription, 3> vertexInputAttributes = {
-		vks::initializers::vertexInputAttributeDescription(0, 0, VK_FORMAT_R32G32_SFLOAT, 0),					// Location 0: Position
-		vks::initializers::vertexInputAttributeDescription(1, 1, VK_FORMAT_R32G32_SFLOAT, offsetof(Vertex, uv)),	// Location 1: UV
-		vks::initializers::vertexInputAttributeDescription(2, 2, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, color)),	// Location 2: Color
-	};
-
-	VkPipelineVertexInputStateCreateInfo vertexInputState = vks::initializers::pipelineVertexInputStateCreateInfo();
-	vertexInputState.vertexBindingDescriptionCount = static_cast<uint32_t>(vertexInputBindings.size());
-	vertexInputState.pVertexBindingDescriptions = vertexInputBindings.data();
-	vertexInputState.vertexAttributeDescriptionCount = static_cast<uint32_t>(vertexInputAttributes.size());
-	vertexInputState.pVertexAttributeDescriptions = vertexInputAttributes.data();
-
-	VkGraphicsPipelineCreateInfo pipelineCreateInfo = vks::initializers::pipelineCreateInfo(pipelineLayout, renderPass, 0);
+	VkGraphicsPipelineCreateInfo pipelineCreateInfo = vks::initializers::pipelineCreateInfo(layout, pass, 0);
 	pipelineCreateInfo.pVertexInputState = &vertexInputState;
 	pipelineCreateInfo.pInputAssemblyState = &inputAssemblyState;
 	pipelineCreateInfo.pRasterizationState = &rasterizationState;
@@ -420,19 +686,80 @@ void TextOverlay::preparePipeline()
 	pipelineCreateInfo.pViewportState = &viewportState;
 	pipelineCreateInfo.pDepthStencilState = &depthStencilState;
 	pipelineCreateInfo.pDynamicState = &dynamicState;
-	pipelineCreateInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
-	pipelineCreateInfo.pStages = shaderStages.data();
+	pipelineCreateInfo.stageCount = 2;
+	pipelineCreateInfo.pStages = stages;
+
+	VkPipelineRenderingCreateInfoKHR renderingInfo = {};
+	if (pass == VK_NULL_HANDLE) {
+		renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR;
+		renderingInfo.colorAttachmentCount = 1;
+		renderingInfo.pColorAttachmentFormats = &format;
+		pipelineCreateInfo.pNext = &renderingInfo;
+	}
+
+	VkPipeline pipe;
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateGraphicsPipelines(vulkanDevice->logicalDevice, pipelineCache, 1, &pipelineCreateInfo, allocator, &pipe));
+	return pipe;
+}
+
+// Atlas upload command buffer if nobody has submitted it yet
+VkCommandBuffer OverlayShared::takeUpload()
+{
+	if (!upload.pending.load(std::memory_order_acquire))
+		return VK_NULL_HANDLE;
+
+	std::lock_guard<std::mutex> l(upload.mutex);
+	if (!upload.pending.load(std::memory_order_relaxed))
+		return VK_NULL_HANDLE;
+	upload.pending.store(false, std::memory_order_relaxed);
+	return upload.cmdBuffer;
+}
+
+// Render pass and pipelines are only compatible with one swapchain format,
+// most apps use just one so this usually ends up with a single entry
+const OverlayPipelines& OverlayShared::getPipelines(VkFormat format)
+{
+	std::lock_guard<std::mutex> l(pipelinesMutex);
+	auto it = pipelines.find(format);
+	if (it != pipelines.end())
+		return it->second;
+
+	auto start = std::chrono::steady_clock::now();
+
+	OverlayPipelines& p = pipelines[format];
+	if (!dynamicRendering)
+		p.renderPass = createRenderPass(format, false);
+
+	// Vertex pulling reads the glyphs from a storage buffer, no vertex input
+	VkPipelineVertexInputStateCreateInfo vertexInputState = pulling ? vks::initializers::pipelineVertexInputStateCreateInfo() : glyphInputState();
+	VkPipelineColorBlendAttachmentState blendAttachmentState = textBlendState();
+	p.pipeline = createPipeline(p.renderPass, format, pipelineLayout, &shaderStages[0], vertexInputState, blendAttachmentState);
+
+	if (cached) {
+		// Cache image onto the swapchain image, it is premultiplied already
+		VkPipelineVertexInputStateCreateInfo emptyInputState = vks::initializers::pipelineVertexInputStateCreateInfo();
+		blendAttachmentState.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+		blendAttachmentState.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+		blendAttachmentState.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+		p.compositePipeline = createPipeline(p.renderPass, format, compositePipelineLayout, &shaderStages[2], emptyInputState, blendAttachmentState);
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	std::cerr << "Pipelines for format " << format << " created in " << elapsed.count()
+		<< " ms (pipeline cache " << (pipelineCacheHit ? "hit)" : "miss)") << std::endl;
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateGraphicsPipelines(vulkanDevice->logicalDevice, pipelineCache, 1, &pipelineCreateInfo, nullptr, &pipeline));
+	savePipelineCache();
+	return p;
 }
 
-// Prepare a separate render pass for rendering the text as an overlay
-void TextOverlay::prepareRenderPass()
+// Prepare a separate render pass for rendering the text as an overlay,
+// or into the offscreen cache image
+VkRenderPass OverlayShared::createRenderPass(VkFormat format, bool offscreen)
 {
 	VkAttachmentDescription attachments[2] = {};
 
 	// Color attachment
-	attachments[0].format = colorFormat;
+	attachments[0].format = format;
 	attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
 	// Don't clear the framebuffer (like the renderpass from the example does)
 	attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
@@ -506,36 +833,430 @@ void TextOverlay::prepareRenderPass()
 	renderPassInfo.dependencyCount = 1;//2;
 	renderPassInfo.pDependencies = subpassDependencies;
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateRenderPass(vulkanDevice->logicalDevice, &renderPassInfo, nullptr, &renderPass));
+	if (offscreen) {
+		// Cache target: cleared every time it gets redrawn, sampled by the composite pass afterwards
+		attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+		attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		attachments[0].finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+		// Wait for earlier composites to stop sampling it, graphics or compute
+		subpassDependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		subpassDependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		subpassDependencies[0].srcAccessMask = 0;
+		subpassDependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+		// Make the new contents visible to the composite
+		subpassDependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		subpassDependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		subpassDependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		subpassDependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+		// Sampling may read any texel, so no by-region here
+		subpassDependencies[0].dependencyFlags = 0;
+		subpassDependencies[1].dependencyFlags = 0;
+		renderPassInfo.dependencyCount = 2;
+	}
+
+	VkRenderPass pass;
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateRenderPass(vulkanDevice->logicalDevice, &renderPassInfo, allocator, &pass));
+	return pass;
+}
+
+TextOverlay::TextOverlay(
+	OverlayShared *shared,
+	std::vector<VkFramebuffer> &framebuffers,
+	VkFormat colorformat,
+	uint32_t framebufferwidth,
+	uint32_t framebufferheight,
+	const std::vector<VkImageView> *imageviews,
+	bool compute)
+{
+	this->shared = shared;
+	this->vulkanDevice = shared->vulkanDevice;
+	this->colorFormat = colorformat;
+
+	this->frameBuffers.resize(framebuffers.size());
+	for (uint32_t i = 0; i < framebuffers.size(); i++)
+	{
+		this->frameBuffers[i] = &framebuffers[i];
+	}
+
+	this->frameBufferWidth = framebufferwidth;
+	this->frameBufferHeight = framebufferheight;
+
+	if (imageviews)
+		imageViews = *imageviews;
+
+	// Compute needs no render pass, so no swapchain format dependent pipelines
+	this->compute = compute && imageviews && shared->compute;
+	pipelines = this->compute ? nullptr : &shared->getPipelines(colorformat);
+
+	cmdBuffers.resize(framebuffers.size());
+	cmdBufferGenerations.assign(framebuffers.size(), UINT64_MAX);
+	cmdBufferSerials.assign(framebuffers.size(), 0);
+	imageDone = std::vector<std::atomic<uint64_t>>(framebuffers.size());
+	for (TextBuffer& text : textBuffers)
+		text.reads = std::vector<std::atomic<uint64_t>>(framebuffers.size());
+	prepareResources();
+
+	if (this->compute) {
+		VkDescriptorPoolSize storagePoolSize = vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, imageViews.size());
+		VkDescriptorPoolCreateInfo storagePoolInfo = vks::initializers::descriptorPoolCreateInfo(1, &storagePoolSize, imageViews.size());
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateDescriptorPool(vulkanDevice->logicalDevice, &storagePoolInfo, shared->allocator, &storagePool));
+
+		storageSets.resize(imageViews.size());
+		for (size_t i = 0; i < storageSets.size(); i++) {
+			VkDescriptorSetAllocateInfo descriptorSetAllocInfo = vks::initializers::descriptorSetAllocateInfo(storagePool, &shared->computeSetLayout, 1);
+			VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateDescriptorSets(vulkanDevice->logicalDevice, &descriptorSetAllocInfo, &storageSets[i]));
+
+			VkDescriptorImageInfo imageDescriptor = vks::initializers::descriptorImageInfo(VK_NULL_HANDLE, imageViews[i], VK_IMAGE_LAYOUT_GENERAL);
+			VkWriteDescriptorSet writeDescriptorSet = vks::initializers::writeDescriptorSet(storageSets[i], VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 0, &imageDescriptor);
+			vulkanDevice->getDispatch()->UpdateDescriptorSets(vulkanDevice->logicalDevice, 1, &writeDescriptorSet, 0, NULL);
+		}
+	}
+}
+
+TextOverlay::~TextOverlay()
+{
+	for (auto& tb : textBuffers)
+	{
+		vulkanDevice->getDispatch()->DestroyBuffer(vulkanDevice->logicalDevice, tb.buffer, shared->allocator);
+		shared->memoryPool.free(tb.memory);
+	}
+
+	if (shared->cached) {
+		destroyCacheTarget(cache);
+		for (auto& r : retiredCaches)
+			destroyCacheTarget(r.second);
+		vulkanDevice->getDispatch()->DestroyDescriptorPool(vulkanDevice->logicalDevice, compositePool, shared->allocator);
+	}
+
+	if (shared->pulling)
+		vulkanDevice->getDispatch()->DestroyDescriptorPool(vulkanDevice->logicalDevice, glyphPool, shared->allocator);
+	if (compute)
+		vulkanDevice->getDispatch()->DestroyDescriptorPool(vulkanDevice->logicalDevice, storagePool, shared->allocator);
+
+	vulkanDevice->getDispatch()->DestroyCommandPool(vulkanDevice->logicalDevice, commandPool, shared->allocator);
+}
+
+// Per swapchain command buffers and text buffers, the rest lives in OverlayShared
+void TextOverlay::prepareResources()
+{
+	// Command buffer
+
+	// Pool
+	VkCommandPoolCreateInfo cmdPoolInfo = {};
+	cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	cmdPoolInfo.queueFamilyIndex = vulkanDevice->queueFamilyIndices.graphics;
+	cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateCommandPool(vulkanDevice->logicalDevice, &cmdPoolInfo, shared->allocator, &commandPool));
+
+	VkCommandBufferAllocateInfo cmdBufAllocateInfo =
+		vks::initializers::commandBufferAllocateInfo(
+			commandPool,
+			VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			(uint32_t)cmdBuffers.size());
+
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateCommandBuffers(vulkanDevice->logicalDevice, &cmdBufAllocateInfo, cmdBuffers.data()));
+
+	const DeviceData *device_data = &g_device_dispatch[GetKey(vulkanDevice->logicalDevice)];
+	for (uint32_t i = 0; i < cmdBuffers.size(); ++i)
+		device_data->set_device_loader_data(vulkanDevice->logicalDevice, cmdBuffers[i]);
+
+	// Instance buffer, one record per glyph. With vertex pulling the shader
+	// reads the smaller GlyphRecord from it as a storage buffer instead
+	VkDeviceSize bufferSize = TEXTOVERLAY_MAX_CHAR_COUNT * (shared->pulling ? sizeof(GlyphRecord) : sizeof(GlyphInstance));
+
+	VkBufferCreateInfo bufferInfo = vks::initializers::bufferCreateInfo(
+		shared->pulling ? VK_BUFFER_USAGE_STORAGE_BUFFER_BIT : VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, bufferSize);
+
+	// Host coherent and mapped for the lifetime of the pool block, no flushes needed
+	for (auto& tb : textBuffers)
+	{
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateBuffer(vulkanDevice->logicalDevice, &bufferInfo, shared->allocator, &tb.buffer));
+
+		tb.memory = shared->memoryPool.bindBuffer(tb.buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		tb.mapped = tb.memory.mapped;
+	}
+
+	if (shared->pulling) {
+		// Set 1 of the pulling pipeline layout, one per text buffer
+		VkDescriptorPoolSize glyphPoolSize = vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, TEXTOVERLAY_BUFFER_COUNT);
+		VkDescriptorPoolCreateInfo glyphPoolInfo = vks::initializers::descriptorPoolCreateInfo(1, &glyphPoolSize, TEXTOVERLAY_BUFFER_COUNT);
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateDescriptorPool(vulkanDevice->logicalDevice, &glyphPoolInfo, shared->allocator, &glyphPool));
+
+		for (auto& tb : textBuffers)
+		{
+			VkDescriptorSetAllocateInfo descriptorSetAllocInfo = vks::initializers::descriptorSetAllocateInfo(glyphPool, &shared->glyphSetLayout, 1);
+			VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateDescriptorSets(vulkanDevice->logicalDevice, &descriptorSetAllocInfo, &tb.descriptorSet));
+
+			VkDescriptorBufferInfo bufferDescriptor = { tb.buffer, 0, bufferSize };
+			VkWriteDescriptorSet writeDescriptorSet = vks::initializers::writeDescriptorSet(tb.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 0, &bufferDescriptor);
+			vulkanDevice->getDispatch()->UpdateDescriptorSets(vulkanDevice->logicalDevice, 1, &writeDescriptorSet, 0, NULL);
+		}
+	}
+
+	if (shared->cached) {
+		cmdBufAllocateInfo.commandBufferCount = 1;
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateCommandBuffers(vulkanDevice->logicalDevice, &cmdBufAllocateInfo, &cacheCmdBuffer));
+		device_data->set_device_loader_data(vulkanDevice->logicalDevice, cacheCmdBuffer);
+
+		// One set per cache image, outgrown ones linger until the GPU is done with them
+		VkDescriptorPoolSize compositePoolSize = vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 8);
+		VkDescriptorPoolCreateInfo compositePoolInfo = vks::initializers::descriptorPoolCreateInfo(1, &compositePoolSize, 8);
+		compositePoolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateDescriptorPool(vulkanDevice->logicalDevice, &compositePoolInfo, shared->allocator, &compositePool));
+	}
+}
+
+// Allocate an RGBA cache image that can hold at least width x height pixels
+void TextOverlay::createCacheTarget(CacheTarget& target, uint32_t width, uint32_t height)
+{
+	target.width = (width + TEXTOVERLAY_CACHE_ALIGN - 1) / TEXTOVERLAY_CACHE_ALIGN * TEXTOVERLAY_CACHE_ALIGN;
+	target.height = (height + TEXTOVERLAY_CACHE_ALIGN - 1) / TEXTOVERLAY_CACHE_ALIGN * TEXTOVERLAY_CACHE_ALIGN;
+
+	VkImageCreateInfo imageInfo = vks::initializers::imageCreateInfo();
+	imageInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+	imageInfo.extent.width = target.width;
+	imageInfo.extent.height = target.height;
+	imageInfo.extent.depth = 1;
+	imageInfo.mipLevels = 1;
+	imageInfo.arrayLayers = 1;
+	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateImage(vulkanDevice->logicalDevice, &imageInfo, shared->allocator, &target.image));
+
+	target.memory = shared->memoryPool.bindImage(target.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	VkImageViewCreateInfo imageViewInfo = vks::initializers::imageViewCreateInfo();
+	imageViewInfo.image = target.image;
+	imageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	imageViewInfo.format = imageInfo.format;
+	imageViewInfo.components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
+	imageViewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateImageView(vulkanDevice->logicalDevice, &imageViewInfo, shared->allocator, &target.view));
+
+	// Dynamic rendering draws straight into the view
+	if (!shared->dynamicRendering) {
+		VkFramebufferCreateInfo fbInfo = vks::initializers::framebufferCreateInfo();
+		fbInfo.renderPass = shared->cacheRenderPass;
+		fbInfo.attachmentCount = 1;
+		fbInfo.pAttachments = &target.view;
+		fbInfo.width = target.width;
+		fbInfo.height = target.height;
+		fbInfo.layers = 1;
+		VK_CHECK_RESULT(vulkanDevice->getDispatch()->CreateFramebuffer(vulkanDevice->logicalDevice, &fbInfo, shared->allocator, &target.framebuffer));
+	}
+
+	VkDescriptorSetAllocateInfo descriptorSetAllocInfo = vks::initializers::descriptorSetAllocateInfo(compositePool, &shared->compositeSetLayout, 1);
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->AllocateDescriptorSets(vulkanDevice->logicalDevice, &descriptorSetAllocInfo, &target.descriptorSet));
+
+	VkDescriptorImageInfo texDescriptor = vks::initializers::descriptorImageInfo(shared->sampler, target.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+	VkWriteDescriptorSet writeDescriptorSet = vks::initializers::writeDescriptorSet(target.descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 0, &texDescriptor);
+	vulkanDevice->getDispatch()->UpdateDescriptorSets(vulkanDevice->logicalDevice, 1, &writeDescriptorSet, 0, NULL);
+}
+
+void TextOverlay::destroyCacheTarget(CacheTarget& target)
+{
+	if (!target.image)
+		return;
+	vulkanDevice->getDispatch()->FreeDescriptorSets(vulkanDevice->logicalDevice, compositePool, 1, &target.descriptorSet);
+	vulkanDevice->getDispatch()->DestroyFramebuffer(vulkanDevice->logicalDevice, target.framebuffer, shared->allocator);
+	vulkanDevice->getDispatch()->DestroyImageView(vulkanDevice->logicalDevice, target.view, shared->allocator);
+	vulkanDevice->getDispatch()->DestroyImage(vulkanDevice->logicalDevice, target.image, shared->allocator);
+	shared->memoryPool.free(target.memory);
+	target = {};
+}
+
+// Text bounds in framebuffer pixels, see textPixelBounds.
+// Zero sized if there is nothing to draw
+VkRect2D TextOverlay::pixelBounds(const TextBuffer& text) const
+{
+	if (text.letters == 0)
+		return {};
+
+	PixelRect rect = textPixelBounds(text.bbox, frameBufferWidth, frameBufferHeight);
+	return vks::initializers::rect2D(rect.width, rect.height, rect.x, rect.y);
+}
+
+// Every image got past the serial listed for it
+bool TextOverlay::completed(const std::vector<uint64_t>& serials) const
+{
+	for (size_t i = 0; i < serials.size(); i++) {
+		if (serials[i] > imageDone[i].load(std::memory_order_acquire))
+			return false;
+	}
+	return true;
+}
+
+// Some submit that read the buffer has not been waited for yet
+bool TextOverlay::textBufferBusy(const TextBuffer& text) const
+{
+	for (size_t i = 0; i < text.reads.size(); i++) {
+		if (text.reads[i].load(std::memory_order_acquire) > imageDone[i].load(std::memory_order_acquire))
+			return true;
+	}
+	return false;
+}
+
+// Render the published text into the cache image, the recorded command
+// buffer goes out with the next submit
+void TextOverlay::updateCache()
+{
+	const TextBuffer& text = textBuffers[readIndex];
+	cacheGeneration = text.generation;
+	cacheRect = {};
+
+	VkRect2D rect = pixelBounds(text);
+	if (rect.extent.width == 0)
+		return;
+
+	if (rect.extent.width > cache.width || rect.extent.height > cache.height) {
+		// Previous frames may still sample the old one
+		if (cache.image)
+			retiredCaches.push_back({cmdBufferSerials, cache});
+		createCacheTarget(cache, std::max(rect.extent.width, cache.width), std::max(rect.extent.height, cache.height));
+	}
+
+	VkCommandBufferBeginInfo cmdBufInfo = vks::initializers::commandBufferBeginInfo();
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->BeginCommandBuffer(cacheCmdBuffer, &cmdBufInfo));
+
+	VkClearValue clearValue;
+	clearValue.color = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+
+	VkImageMemoryBarrier cacheBarrier = vks::initializers::imageMemoryBarrier();
+	cacheBarrier.image = cache.image;
+	cacheBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+	if (shared->dynamicRendering) {
+		// Same transitions as cacheRenderPass, spelled out
+		cacheBarrier.srcAccessMask = 0;
+		cacheBarrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		cacheBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		cacheBarrier.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		vulkanDevice->getDispatch()->CmdPipelineBarrier(cacheCmdBuffer,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			0, 0, nullptr, 0, nullptr, 1, &cacheBarrier);
+
+		VkRenderingAttachmentInfoKHR colorAttachment {};
+		colorAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+		colorAttachment.imageView = cache.view;
+		colorAttachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+		colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		colorAttachment.clearValue = clearValue;
+
+		VkRenderingInfoKHR renderingInfo {};
+		renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR;
+		renderingInfo.renderArea.extent = rect.extent;
+		renderingInfo.layerCount = 1;
+		renderingInfo.colorAttachmentCount = 1;
+		renderingInfo.pColorAttachments = &colorAttachment;
+		shared->cmdBeginRendering(cacheCmdBuffer, &renderingInfo);
+	} else {
+		VkRenderPassBeginInfo renderPassBeginInfo = vks::initializers::renderPassBeginInfo();
+		renderPassBeginInfo.renderPass = shared->cacheRenderPass;
+		renderPassBeginInfo.framebuffer = cache.framebuffer;
+		renderPassBeginInfo.renderArea.extent = rect.extent;
+		renderPassBeginInfo.clearValueCount = 1;
+		renderPassBeginInfo.pClearValues = &clearValue;
+		vulkanDevice->getDispatch()->CmdBeginRenderPass(cacheCmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+	}
+
+	// Glyphs are in swapchain NDC, shift the viewport so the text lands at the cache origin
+	VkViewport viewport = vks::initializers::viewport((float)frameBufferWidth, (float)frameBufferHeight, 0.0f, 1.0f);
+	viewport.x = -(float)rect.offset.x;
+	viewport.y = -(float)rect.offset.y;
+	vulkanDevice->getDispatch()->CmdSetViewport(cacheCmdBuffer, 0, 1, &viewport);
+
+	VkRect2D scissor = vks::initializers::rect2D(rect.extent.width, rect.extent.height, 0, 0);
+	vulkanDevice->getDispatch()->CmdSetScissor(cacheCmdBuffer, 0, 1, &scissor);
+
+	vulkanDevice->getDispatch()->CmdBindPipeline(cacheCmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shared->cachePipeline);
+	drawText(cacheCmdBuffer, text);
+
+	if (shared->dynamicRendering) {
+		shared->cmdEndRendering(cacheCmdBuffer);
+
+		cacheBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		cacheBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		cacheBarrier.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		cacheBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		vulkanDevice->getDispatch()->CmdPipelineBarrier(cacheCmdBuffer,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			0, 0, nullptr, 0, nullptr, 1, &cacheBarrier);
+	} else {
+		vulkanDevice->getDispatch()->CmdEndRenderPass(cacheCmdBuffer);
+	}
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->EndCommandBuffer(cacheCmdBuffer));
+
+	cacheRect = rect;
+	cachePending = true;
+}
+
+// Bind the glyphs of a text buffer and draw them, the pipeline is already bound
+void TextOverlay::drawText(VkCommandBuffer cmdBuffer, const TextBuffer& text)
+{
+	if (shared->pulling) {
+		VkDescriptorSet sets[] = { shared->descriptorSet, text.descriptorSet };
+		glm::vec2 fbSize((float)frameBufferWidth, (float)frameBufferHeight);
+		vulkanDevice->getDispatch()->CmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shared->pipelineLayout, 0, 2, sets, 0, NULL);
+		vulkanDevice->getDispatch()->CmdPushConstants(cmdBuffer, shared->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(fbSize), &fbSize);
+	} else {
+		VkDeviceSize offsets[] = { 0 };
+		vulkanDevice->getDispatch()->CmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shared->pipelineLayout, 0, 1, &shared->descriptorSet, 0, NULL);
+		vulkanDevice->getDispatch()->CmdBindVertexBuffers(cmdBuffer, VERTEX_BUFFER_BIND_ID, 1, &text.buffer, offsets);
+	}
+
+	// All glyphs in one go, 4 strip vertices per instance
+	if (text.letters > 0)
+		vulkanDevice->getDispatch()->CmdDraw(cmdBuffer, 4, text.letters, 0, 0);
 }
 
 // Map buffer 
-void TextOverlay::beginTextUpdate()
+bool TextOverlay::beginTextUpdate()
 {
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->MapMemory(vulkanDevice->logicalDevice, memory[bufferIndex], 0, VK_WHOLE_SIZE, 0, (void **)&mapped));
+	if (textBufferBusy(textBuffers[writeIndex])) {
+		// A parked buffer the reader has not picked up was never handed to the GPU,
+		// overwrite that one and park the busy one in its place
+		uint32_t parked = published.load(std::memory_order_acquire);
+		if (!(parked & TEXTOVERLAY_FRESH)
+			|| !published.compare_exchange_strong(parked, writeIndex, std::memory_order_acq_rel))
+			return false;
+		writeIndex = parked & ~TEXTOVERLAY_FRESH;
+	}
+
+	if (shared->pulling)
+		records = (GlyphRecord *)textBuffers[writeIndex].mapped;
+	else
+		mapped = (GlyphInstance *)textBuffers[writeIndex].mapped;
 	numLetters = 0;
+	bbox = TextBounds();
+	return true;
 }
 
 // Add text to the current buffer
 // todo : drop shadow? color attribute?
-void TextOverlay::addText(std::string text, float x, float y, float scale, TextAlign align)
+void TextOverlay::addText(std::string text, float x, float y, float scale, TextAlign align, uint32_t color)
 {
-	const uint32_t firstChar = STB_FONT_consolas_bold_24_latin1_FIRST_CHAR;
+	const uint32_t firstChar = font_atlas_first_char;
 
 	if (numLetters >= TEXTOVERLAY_MAX_CHAR_COUNT) {
 		printf("text vertex buffer is full! skipping...\n");
 		return;
 	}
 
-	assert(mapped != nullptr);
-
-	const float charW = (1.5f * scale) / frameBufferWidth;
-	const float charH = (1.5f * scale) / frameBufferHeight;
+	assert(mapped != nullptr || records != nullptr);
 
+	TextPen pen(x, y, scale, frameBufferWidth, frameBufferHeight);
 	float fbW = (float)frameBufferWidth;
 	float fbH = (float)frameBufferHeight;
-	x = (x / fbW * 2.0f) - 1.0f;
-	y = (y / fbH * 2.0f) - 1.0f;
 
 	// Calculate text width
 	float textWidth = 0;
@@ -601,23 +1322,23 @@ void TextOverlay::addText(std::string text, float x, float y, float scale, TextA
 		else if (fifo.back() == 0xC3) {
 			letter = letter + 64;
 		}
-		else if(fifo.back() >= 0xC2 || (uint32_t)(letter & 0xFF) - firstChar >= STB_FONT_consolas_bold_24_latin1_NUM_CHARS) {
+		else if(fifo.back() >= 0xC2 || (uint32_t)(letter & 0xFF) - firstChar >= font_atlas_num_chars) {
 			letter = '?';
 			//continue;
 		}
 		fifo.back() = 0;
 
-		stb_fontchar *charData = &stbFontData[(uint32_t)(letter & 0xFF) - firstChar];
-		textWidth += charData->advance * charW;
+		const stb_fontchar *charData = &font_atlas_chars[(uint32_t)(letter & 0xFF) - firstChar];
+		textWidth += charData->advance * pen.charW;
 	}
 
 	switch (align)
 	{
 		case alignRight:
-			x -= textWidth;
+			pen.x -= textWidth;
 			break;
 		case alignCenter:
-			x -= textWidth / 2.0f;
+			pen.x -= textWidth / 2.0f;
 			break;
 		default:
 			break;
@@ -672,51 +1393,43 @@ void TextOverlay::addText(std::string text, float x, float y, float scale, TextA
 		else if (prev_letter == 0xC3){
 			letter = letter + 64;
 		}
-		else if (prev_letter >= 0xC2 || (uint32_t)(letter & 0xFF) - firstChar >= STB_FONT_consolas_bold_24_latin1_NUM_CHARS) {
+		else if (prev_letter >= 0xC2 || (uint32_t)(letter & 0xFF) - firstChar >= font_atlas_num_chars) {
 			//continue;
 			letter = '?';
 		}
 		prev_letter = 0;
 
-		stb_fontchar *charData = &stbFontData[(uint32_t)(letter & 0xFF) - firstChar];
-
-		mapped->pos.x = (x + (float)charData->x0 * charW * scale);// - charW;
-		mapped->pos.y = (y + (float)charData->y0 * charH * scale);// - charH;
-		mapped->uv.x = charData->s0;
-		mapped->uv.y = charData->t0;
-		mapped->color.x = fontColor[0];
-		mapped->color.y = fontColor[1];
-		mapped->color.z = fontColor[2];
-		mapped++;
-
-		mapped->pos.x = (x + (float)charData->x1 * charW * scale);// + charW;
-		mapped->pos.y = (y + (float)charData->y0 * charH * scale);// - charH;
-		mapped->uv.x = charData->s1;
-		mapped->uv.y = charData->t0;
-		mapped->color.x = fontColor[0];
-		mapped->color.y = fontColor[1];
-		mapped->color.z = fontColor[2];
-		mapped++;
-
-		mapped->pos.x = (x + (float)charData->x0 * charW * scale);// - charW;
-		mapped->pos.y = (y + (float)charData->y1 * charH * scale);// + charH;
-		mapped->uv.x = charData->s0;
-		mapped->uv.y = charData->t1;
-		mapped->color.x = fontColor[0];
-		mapped->color.y = fontColor[1];
-		mapped->color.z = fontColor[2];
-		mapped++;
-
-		mapped->pos.x = (x + (float)charData->x1 * charW * scale);// + charW;
-		mapped->pos.y = (y + (float)charData->y1 * charH * scale);// + charH;
-		mapped->uv.x = charData->s1;
-		mapped->uv.y = charData->t1;
-		mapped->color.x = fontColor[0];
-		mapped->color.y = fontColor[1];
-		mapped->color.z = fontColor[2];
-		mapped++;
-
-		x += charData->advance * charW * scale;
+		const stb_fontchar *charData = &font_atlas_chars[(uint32_t)(letter & 0xFF) - firstChar];
+
+		GlyphQuad quad = pen.place(*charData);
+		bbox.add(quad);
+
+		if (records) {
+			// Pen position and glyph index only, overlay_pull.vert looks up the rest
+			records->x = packQuarterPixel((quad.penX + 1.0f) * 0.5f * fbW);
+			records->y = packQuarterPixel((quad.penY + 1.0f) * 0.5f * fbH);
+			records->glyph = (uint8_t)((uint32_t)(letter & 0xFF) - firstChar);
+			records->color = (uint8_t)std::min(color, TEXTOVERLAY_PALETTE_SIZE - 1u);
+			records->scale = (uint16_t)std::min(roundf(scale * 256.0f), 65535.0f);
+			records++;
+		} else {
+			// Spaces and glyphs off screen take no instance
+			glm::vec4 pos(quad.x0, quad.y0, quad.x1, quad.y1);
+			glm::vec4 uv(charData->s0, charData->t0, charData->s1, charData->t1);
+			if (!clipGlyph(pos, uv))
+				continue;
+
+			mapped->pos[0] = packSnorm16(pos.x);
+			mapped->pos[1] = packSnorm16(pos.y);
+			mapped->pos[2] = packSnorm16(pos.z);
+			mapped->pos[3] = packSnorm16(pos.w);
+			mapped->uv[0] = packUnorm16(uv.x);
+			mapped->uv[1] = packUnorm16(uv.y);
+			mapped->uv[2] = packUnorm16(uv.z);
+			mapped->uv[3] = packUnorm16(uv.w);
+			mapped->color = std::min(color, TEXTOVERLAY_PALETTE_SIZE - 1u);
+			mapped++;
+		}
 
 		numLetters++;
 		if (numLetters >= TEXTOVERLAY_MAX_CHAR_COUNT)
@@ -724,37 +1437,79 @@ void TextOverlay::addText(std::string text, float x, float y, float scale, TextA
 	}
 }
 
-// Unmap buffer and update command buffers
+// Park the filled buffer for the present thread and continue with whatever
+// was parked before, a stale buffer the reader skipped or the one it let go of
 void TextOverlay::endTextUpdate()
 {
-	vulkanDevice->getDispatch()->UnmapMemory(vulkanDevice->logicalDevice, memory[bufferIndex]);
 	mapped = nullptr;
+	records = nullptr;
 
-	std::lock_guard<std::mutex> l(biMutex);
-	renderIndex = bufferIndex;
-	bufferIndex = 1 - renderIndex;
+	TextBuffer& text = textBuffers[writeIndex];
+	text.letters = std::min(numLetters, TEXTOVERLAY_MAX_CHAR_COUNT);
+	text.bbox = bbox;
+	text.generation = ++writeGeneration;
+
+	writeIndex = published.exchange(writeIndex | TEXTOVERLAY_FRESH, std::memory_order_acq_rel) & ~TEXTOVERLAY_FRESH;
 }
 
 // Needs to be called by the application
 void TextOverlay::updateCommandBuffers(uint32_t i, VkImageMemoryBarrier imb)
 {
-	std::lock_guard<std::mutex> l(biMutex);
+	// Pick up the newest text, if any
+	if (published.load(std::memory_order_relaxed) & TEXTOVERLAY_FRESH)
+		readIndex = published.exchange(readIndex, std::memory_order_acq_rel) & ~TEXTOVERLAY_FRESH;
+	const TextBuffer& text = textBuffers[readIndex];
+
+	// Caller waited for this image's fence or timeline value, so its last submit is done
+	imageDone[i].store(cmdBufferSerials[i], std::memory_order_release);
+
+	uint64_t target = text.generation;
+	if (shared->cached) {
+		for (auto retired = retiredCaches.begin(); retired != retiredCaches.end();) {
+			if (completed(retired->first)) {
+				destroyCacheTarget(retired->second);
+				retired = retiredCaches.erase(retired);
+			} else {
+				retired++;
+			}
+		}
+
+		// Redraw the cache once per text update, unless the GPU still runs the last redraw
+		if (cacheGeneration != text.generation && !cachePending && cacheSerial <= imageDone[cacheImage].load(std::memory_order_relaxed))
+			updateCache();
+		target = cacheGeneration;
+	}
+
+	// Still up to date, resubmit as is
+	if (cmdBufferGenerations[i] == target)
+		return;
+
+	if (compute) {
+		recordComputeComposite(i, imb);
+		cmdBufferGenerations[i] = target;
+		return;
+	}
+
 	VkCommandBufferBeginInfo cmdBufInfo = vks::initializers::commandBufferBeginInfo();
 
 	VkClearValue clearValues[2];
 	clearValues[1].color = { { 0.0f, 0.0f, 0.0f, 0.0f } };
 
+	// Only load and store the pixels the text covers, not the whole swapchain image.
+	// Nothing to draw still needs a pass for the layout transition, keep it at one pixel
+	VkRect2D area = shared->cached ? cacheRect : pixelBounds(text);
+	if (area.extent.width == 0)
+		area = vks::initializers::rect2D(1, 1, 0, 0);
+
 	VkRenderPassBeginInfo renderPassBeginInfo = vks::initializers::renderPassBeginInfo();
-	renderPassBeginInfo.renderPass = renderPass;
-	renderPassBeginInfo.renderArea.extent.width = frameBufferWidth;
-	renderPassBeginInfo.renderArea.extent.height = frameBufferHeight;
+	renderPassBeginInfo.renderPass = pipelines->renderPass;
+	renderPassBeginInfo.renderArea = area;
 	renderPassBeginInfo.clearValueCount = 0;//2;
 	renderPassBeginInfo.pClearValues = clearValues;
 
 	//for (uint32_t i = 0; i < cmdBuffers.size(); ++i)
 	{
 		//printf("updateCommandBuffers %d fb %p\n", i, *frameBuffers[i]);
-		renderPassBeginInfo.framebuffer = *frameBuffers[i];
 
 		VK_CHECK_RESULT(vulkanDevice->getDispatch()->BeginCommandBuffer(cmdBuffers[i], &cmdBufInfo));
 
@@ -765,44 +1520,133 @@ void TextOverlay::updateCommandBuffers(uint32_t i, VkImageMemoryBarrier imb)
 										  0, nullptr, /* memory barriers */
 										  0, nullptr, /* buffer memory barriers */
 										  1, &imb);   /* image memory barriers */
-		vulkanDevice->getDispatch()->CmdBeginRenderPass(cmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+		if (shared->dynamicRendering) {
+			VkRenderingAttachmentInfoKHR colorAttachment {};
+			colorAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+			colorAttachment.imageView = imageViews[i];
+			colorAttachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+			colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+			colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+
+			VkRenderingInfoKHR renderingInfo {};
+			renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR;
+			renderingInfo.renderArea = area;
+			renderingInfo.layerCount = 1;
+			renderingInfo.colorAttachmentCount = 1;
+			renderingInfo.pColorAttachments = &colorAttachment;
+			shared->cmdBeginRendering(cmdBuffers[i], &renderingInfo);
+		} else {
+			renderPassBeginInfo.framebuffer = *frameBuffers[i];
+			vulkanDevice->getDispatch()->CmdBeginRenderPass(cmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+		}
 
 		VkViewport viewport = vks::initializers::viewport((float)frameBufferWidth, (float)frameBufferHeight, 0.0f, 1.0f);
 		vulkanDevice->getDispatch()->CmdSetViewport(cmdBuffers[i], 0, 1, &viewport);
 
-		VkRect2D scissor = vks::initializers::rect2D(frameBufferWidth, frameBufferHeight, 0, 0);
-		vulkanDevice->getDispatch()->CmdSetScissor(cmdBuffers[i], 0, 1, &scissor);
-
-		vulkanDevice->getDispatch()->CmdBindPipeline(cmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-		vulkanDevice->getDispatch()->CmdBindDescriptorSets(cmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, NULL);
-
-		VkDeviceSize offsets[] = { 0 };
-		vulkanDevice->getDispatch()->CmdBindVertexBuffers(cmdBuffers[i], 0, 1, &buffer[renderIndex], offsets);
-		vulkanDevice->getDispatch()->CmdBindVertexBuffers(cmdBuffers[i], 1, 1, &buffer[renderIndex], offsets);
-		vulkanDevice->getDispatch()->CmdBindVertexBuffers(cmdBuffers[i], 2, 1, &buffer[renderIndex], offsets);
-
-		numLetters = std::min(numLetters, TEXTOVERLAY_MAX_CHAR_COUNT);
-		for (uint32_t j = 0; j < numLetters; j++)
-		{
-			vulkanDevice->getDispatch()->CmdDraw(cmdBuffers[i], 4, 1, j * 4, 0);
+		vulkanDevice->getDispatch()->CmdSetScissor(cmdBuffers[i], 0, 1, &area);
+
+		if (shared->cached) {
+			// One quad with the cached text
+			if (cacheRect.extent.width > 0) {
+				CompositeRect rect;
+				rect.pos.x = (float)cacheRect.offset.x / frameBufferWidth * 2.0f - 1.0f;
+				rect.pos.y = (float)cacheRect.offset.y / frameBufferHeight * 2.0f - 1.0f;
+				rect.pos.z = (float)(cacheRect.offset.x + cacheRect.extent.width) / frameBufferWidth * 2.0f - 1.0f;
+				rect.pos.w = (float)(cacheRect.offset.y + cacheRect.extent.height) / frameBufferHeight * 2.0f - 1.0f;
+				rect.uv = glm::vec4(0.0f, 0.0f,
+					(float)cacheRect.extent.width / cache.width,
+					(float)cacheRect.extent.height / cache.height);
+
+				vulkanDevice->getDispatch()->CmdBindPipeline(cmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines->compositePipeline);
+				vulkanDevice->getDispatch()->CmdBindDescriptorSets(cmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, shared->compositePipelineLayout, 0, 1, &cache.descriptorSet, 0, NULL);
+				vulkanDevice->getDispatch()->CmdPushConstants(cmdBuffers[i], shared->compositePipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(rect), &rect);
+				vulkanDevice->getDispatch()->CmdDraw(cmdBuffers[i], 4, 1, 0, 0);
+			}
+		} else {
+			vulkanDevice->getDispatch()->CmdBindPipeline(cmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines->pipeline);
+			drawText(cmdBuffers[i], text);
 		}
 
-		vulkanDevice->getDispatch()->CmdEndRenderPass(cmdBuffers[i]);
+		if (shared->dynamicRendering) {
+			shared->cmdEndRendering(cmdBuffers[i]);
+
+			// What the render pass' finalLayout did
+			imb.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+			imb.dstAccessMask = 0;
+			imb.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+			imb.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+			vulkanDevice->getDispatch()->CmdPipelineBarrier(cmdBuffers[i],
+											  VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+											  VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+											  0, 0, nullptr, 0, nullptr, 1, &imb);
+		} else {
+			vulkanDevice->getDispatch()->CmdEndRenderPass(cmdBuffers[i]);
+		}
 
 		VK_CHECK_RESULT(vulkanDevice->getDispatch()->EndCommandBuffer(cmdBuffers[i]));
+		cmdBufferGenerations[i] = target;
 	}
 }
 
-// Submit the text command buffers to a queue
-// Does a queue wait idle
-void TextOverlay::submit(VkQueue queue, uint32_t bufferindex, VkSubmitInfo submitInfo, VkFence fence)
+// Blend the cache tile into the swapchain image as a storage image, only the
+// pixels of the tile are touched and there is no render pass at all
+void TextOverlay::recordComputeComposite(uint32_t i, VkImageMemoryBarrier imb)
 {
-	//VkSubmitInfo submitInfo = {};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	//submitInfo.commandBufferCount = visible ? 1 : 0; // toggle rendering, but call VkQueueSubmit so present semaphore gets signalled
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &cmdBuffers[bufferindex];
+	VkCommandBufferBeginInfo cmdBufInfo = vks::initializers::commandBufferBeginInfo();
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->BeginCommandBuffer(cmdBuffers[i], &cmdBufInfo));
+
+	imb.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	imb.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+	imb.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vulkanDevice->getDispatch()->CmdPipelineBarrier(cmdBuffers[i],
+		VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 0, nullptr, 0, nullptr, 1, &imb);
+
+	if (cacheRect.extent.width > 0) {
+		CompositeTile tile = {
+			{ cacheRect.offset.x, cacheRect.offset.y },
+			{ (int32_t)cacheRect.extent.width, (int32_t)cacheRect.extent.height },
+		};
+		VkDescriptorSet sets[] = { cache.descriptorSet, storageSets[i] };
+
+		vulkanDevice->getDispatch()->CmdBindPipeline(cmdBuffers[i], VK_PIPELINE_BIND_POINT_COMPUTE, shared->computePipeline);
+		vulkanDevice->getDispatch()->CmdBindDescriptorSets(cmdBuffers[i], VK_PIPELINE_BIND_POINT_COMPUTE, shared->computePipelineLayout, 0, 2, sets, 0, NULL);
+		vulkanDevice->getDispatch()->CmdPushConstants(cmdBuffers[i], shared->computePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(tile), &tile);
+		// 8x8 workgroups, see composite.comp
+		vulkanDevice->getDispatch()->CmdDispatch(cmdBuffers[i], (cacheRect.extent.width + 7) / 8, (cacheRect.extent.height + 7) / 8, 1);
+	}
 
-	VK_CHECK_RESULT(vulkanDevice->getDispatch()->QueueSubmit(queue, 1, &submitInfo, fence));
-	//VK_CHECK_RESULT(vulkanDevice->getDispatch()->WaitForFences(vulkanDevice->logicalDevice, 1, &fence, VK_TRUE, UINT64_MAX));
+	imb.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+	imb.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	imb.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	imb.dstAccessMask = 0;
+	vulkanDevice->getDispatch()->CmdPipelineBarrier(cmdBuffers[i],
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+		0, 0, nullptr, 0, nullptr, 1, &imb);
+
+	VK_CHECK_RESULT(vulkanDevice->getDispatch()->EndCommandBuffer(cmdBuffers[i]));
+}
+
+// Queue up the text command buffers, the caller submits them
+void TextOverlay::appendCommandBuffers(uint32_t bufferindex, std::vector<VkCommandBuffer>& cmds)
+{
+	// Font atlas copy, once per device
+	VkCommandBuffer uploadCmd = shared->takeUpload();
+	if (uploadCmd != VK_NULL_HANDLE)
+		cmds.push_back(uploadCmd);
+
+	submitSerial++;
+	// The text is read by the cache redraw, or by the draw itself without a cache
+	if (cachePending || !shared->cached)
+		textBuffers[readIndex].reads[bufferindex].store(submitSerial, std::memory_order_release);
+	if (cachePending) {
+		// Cache redraw goes first, the composite in the same batch samples it
+		cmds.push_back(cacheCmdBuffer);
+		cachePending = false;
+		cacheImage = bufferindex;
+		cacheSerial = submitSerial;
+	}
+	cmds.push_back(cmdBuffers[bufferindex]);
+	cmdBufferSerials[bufferindex] = submitSerial;
 }
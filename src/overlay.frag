@@ -1,16 +1,12 @@
 #version 450 core
 
 layout (location = 0) in vec2 inUV;
-layout (location = 1) in vec3 inCol;
+layout (location = 1) in vec4 inCol;
 
 layout (binding = 0) uniform sampler2D s_font;
 
 layout (location = 0) out vec4 outFragColor;
 
-layout (binding = 1) uniform TextColor {
-	vec4 color;
-};
-
 const float smoothing = 1.0/16.0;
 const vec2 shadowOffset = vec2(-1.0/512.0);
 const vec4 glowColor = vec4(vec3(1), 1.0);
@@ -29,7 +25,7 @@ vec4 shadowGlowText(void)
 	//float mask = color.a-alpha;
 	float mask = 1.0-alpha;
 
-	vec4 base = vec4(color.rgb, color.a*value);
+	vec4 base = vec4(inCol.rgb, inCol.a*value);
 	return mix(base, glow, mask);
 }
 
@@ -44,7 +40,7 @@ vec4 shadowedText(void)
 	float r_alpha_center = sampleAlpha(0.0f, 5.0f);
 	float r_alpha_shadow = sampleAlpha(0.3f, 5.0f);
 
-	vec4 r_center = vec4(color.rgb, color.a * r_alpha_center);
+	vec4 r_center = vec4(inCol.rgb, inCol.a * r_alpha_center);
 	vec4 r_shadow = vec4(0.0f, 0.0f, 0.0f, r_alpha_shadow);
 
 	vec4 o_color = mix(r_shadow, r_center, r_alpha_center);
@@ -56,7 +52,7 @@ vec4 plainText(void)
 {
 	float value = texture(s_font, inUV).r;
 	vec4 shadow = vec4(vec3(1), texture(s_font, inUV + shadowOffset).r);
-	return mix(vec4(inCol.rgb, value*color.a), shadow, 1-value);
+	return mix(vec4(inCol.rgb, value*inCol.a), shadow, 1-value);
 }
 
 void main(void)
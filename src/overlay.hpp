@@ -2,7 +2,9 @@
 #include "vk_dispatch_table_helper.h"
 
 #include <vector>
+#include <map>
 #include <mutex>
+#include <atomic>
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
@@ -12,43 +14,150 @@
 
 #include "vks/VulkanTools.h"
 #include "vks/VulkanDevice.hpp"
+#include "memory_pool.hpp"
+#include "text_bounds.hpp"
 
-#include "../external/stb/stb_font_consolas_bold_24_latin1.inl"
+// Max. number of colors addText can pick from
+#define TEXTOVERLAY_PALETTE_SIZE 4
 
-struct Vertex
+// Per glyph instance data, overlay.vert expands it to a quad.
+// Fetched as normalized 16 bit values, see glyphAttributes in overlay.cpp
+struct GlyphInstance
 {
-	glm::vec2 pos;
-	glm::vec2 uv;
-	glm::vec3 color;
+	int16_t pos[4];  // x0, y0, x1, y1 in NDC (SNORM16)
+	uint16_t uv[4];  // s0, t0, s1, t1 in the font atlas (UNORM16)
+	uint32_t color;  // index into the palette uniform
+};
+static_assert(sizeof(GlyphInstance) == 20, "GlyphInstance should be tightly packed");
+
+// Vertex pulling record (NUUDEL_VERTEX_PULLING), overlay_pull.vert reads it
+// from a storage buffer as an uvec2 and builds the quad from GlyphMetric
+struct GlyphRecord
+{
+	int16_t x, y;    // pen position in framebuffer pixels, 1/4 pixel units
+	uint8_t glyph;   // index into the font metrics
+	uint8_t color;   // index into the palette uniform
+	uint16_t scale;  // 8.8 fixed point
+};
+static_assert(sizeof(GlyphRecord) == 8, "GlyphRecord should be tightly packed");
+
+// Font metrics as laid out in the storage buffer (std430)
+struct GlyphMetric
+{
+	glm::vec4 rect;  // x0, y0, x1, y1 in font pixels relative to the pen
+	glm::vec4 uv;    // s0, t0, s1, t1 in the font atlas
+};
+
+// Instance buffers in flight between the text writer and the present thread
+#define TEXTOVERLAY_BUFFER_COUNT 3
+
+// One persistently mapped glyph buffer and what was written into it
+struct TextBuffer
+{
+	VkBuffer buffer = VK_NULL_HANDLE;
+	MemoryAllocation memory;
+	void *mapped = nullptr;  // GlyphInstance, or GlyphRecord with vertex pulling
+	VkDescriptorSet descriptorSet = VK_NULL_HANDLE;  // vertex pulling only
+	uint32_t letters = 0;
+	TextBounds bbox;
+	uint64_t generation = 0;
+	// Per swapchain image, serial of the last submit that read this buffer
+	std::vector<std::atomic<uint64_t>> reads;
+};
+
+// Offscreen RGBA copy of the rendered text (NUUDEL_OFFSCREEN)
+struct CacheTarget
+{
+	VkImage image = VK_NULL_HANDLE;
+	MemoryAllocation memory;
+	VkImageView view = VK_NULL_HANDLE;
+	VkFramebuffer framebuffer = VK_NULL_HANDLE;
+	VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+	uint32_t width = 0, height = 0;
+};
+
+// Swapchain format dependent objects
+struct OverlayPipelines
+{
+	VkRenderPass renderPass = VK_NULL_HANDLE;
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	VkPipeline compositePipeline = VK_NULL_HANDLE;
 };
 
 /*
-	Mostly self-contained text overlay class
+	Per device overlay resources: font atlas, sampler, descriptors, shaders
+	and pipelines. Shared by the TextOverlay of every swapchain, so that
+	recreating a swapchain (resize, fullscreen toggle) only has to build
+	new framebuffers and command buffers.
 */
-class TextOverlay
+class OverlayShared
 {
 private:
-	vks::VulkanDevice *vulkanDevice;
+	std::mutex pipelinesMutex;
+	std::map<VkFormat, OverlayPipelines> pipelines;
 
-	VkQueue queue;
-	VkFormat colorFormat;
-//	VkFormat depthFormat;
+	VkPipelineShaderStageCreateInfo loadShader(const uint32_t *shaderCode, const size_t size, VkShaderStageFlagBits stage);
+	// Without a render pass the pipeline is for dynamic rendering to `format`
+	VkPipeline createPipeline(VkRenderPass pass, VkFormat format, VkPipelineLayout layout,
+		const VkPipelineShaderStageCreateInfo *stages,
+		const VkPipelineVertexInputStateCreateInfo& vertexInputState,
+		const VkPipelineColorBlendAttachmentState& blendAttachmentState);
+	VkRenderPass createRenderPass(VkFormat format, bool offscreen);
 
+	// On-disk pipeline cache under $XDG_CACHE_HOME/nuudel, keyed by vendor,
+	// device and pipelineCacheUUID
+	std::string pipelineCachePath;
+	size_t pipelineCacheSize = 0;
+	bool pipelineCacheHit = false;
+	void loadPipelineCache();
+	void savePipelineCache();
 
-	// TextOverlay gets recreated when swpachain resizes so take these as values
-	uint32_t frameBufferWidth;
-	uint32_t frameBufferHeight;
-	int bufferIndex = 0, renderIndex = 0;
-	std::mutex biMutex;
+	// Record the font atlas upload and set up the descriptors
+	void prepareResources();
+
+	// The atlas copy is recorded here but submitted with the first TextOverlay,
+	// the staging buffer stays around until the device goes away
+	struct {
+		VkCommandPool commandPool;
+		VkCommandBuffer cmdBuffer;
+		VkBuffer stagingBuffer;
+		MemoryAllocation stagingMemory;
+		std::atomic<bool> pending { false };
+		std::mutex mutex;
+	} upload;
+
+public:
+	vks::VulkanDevice *vulkanDevice;
+	// The device's callbacks, TextOverlays create their objects with them too
+	const VkAllocationCallbacks *allocator;
+	// Backs every buffer and image of the overlay, TextOverlays included
+	MemoryPool memoryPool;
+
+	// NUUDEL_OFFSCREEN
+	bool cached = false;
+	// NUUDEL_VERTEX_PULLING
+	bool pulling = false;
+	// NUUDEL_COMPUTE and the device can use it, implies `cached`
+	bool compute = false;
+	// Device has dynamic rendering, no render passes or framebuffers get created
+	bool dynamicRendering = false;
+	PFN_vkCmdBeginRenderingKHR cmdBeginRendering = nullptr;
+	PFN_vkCmdEndRenderingKHR cmdEndRendering = nullptr;
+
+	// Entry 0 is the default text color (NUUDEL_RGBA)
+	glm::vec4 palette[TEXTOVERLAY_PALETTE_SIZE] = {
+		{1.0f, 1.0f, 1.0f, 1.0f},
+		{1.0f, 1.0f, 0.0f, 1.0f},
+		{1.0f, 0.0f, 0.0f, 1.0f},
+		{0.0f, 1.0f, 0.0f, 1.0f},
+	};
 
 	VkSampler sampler;
 	VkImage image;
 	VkImageView view;
-	VkBuffer buffer[2];
-	VkDeviceMemory memory[2];
-	VkDeviceMemory imageMemory;
+	MemoryAllocation imageMemory;
 	struct {
-		VkDeviceMemory memory;
+		MemoryAllocation memory;
 		VkBuffer buffer;
 		VkDescriptorBufferInfo descriptor;
 	} uniformBuffer;
@@ -57,62 +166,172 @@ private:
 	VkDescriptorSet descriptorSet;
 	VkPipelineLayout pipelineLayout;
 	VkPipelineCache pipelineCache;
-	VkPipeline pipeline;
-	VkRenderPass renderPass;
+	// Vertex pulling: glyph metrics in set 0, the glyph records of a TextOverlay in set 1
+	struct {
+		MemoryAllocation memory;
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VkDescriptorBufferInfo descriptor;
+	} metricsBuffer;
+	VkDescriptorSetLayout glyphSetLayout = VK_NULL_HANDLE;
+	std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
+
+	// Offscreen mode, the cache image is always RGBA8 so these don't depend on the swapchain.
+	// No cacheRenderPass with dynamic rendering
+	VkRenderPass cacheRenderPass = VK_NULL_HANDLE;
+	VkPipeline cachePipeline = VK_NULL_HANDLE;
+	VkPipelineLayout compositePipelineLayout = VK_NULL_HANDLE;
+	VkDescriptorSetLayout compositeSetLayout = VK_NULL_HANDLE;
+
+	// Compute composite: cache in set 0, swapchain storage image in set 1
+	VkPipeline computePipeline = VK_NULL_HANDLE;
+	VkPipelineLayout computePipelineLayout = VK_NULL_HANDLE;
+	VkDescriptorSetLayout computeSetLayout = VK_NULL_HANDLE;
+
+	// NUUDEL_COMPUTE, the layer needs it before any OverlayShared exists to
+	// ask for storage usage on the swapchain
+	static bool computeRequested();
+
+	// Does not touch any queue, so it can be created on a worker thread
+	OverlayShared(vks::VulkanDevice *vulkanDevice, const VkAllocationCallbacks *allocator = nullptr);
+	~OverlayShared();
+
+	// Returns the atlas upload command buffer exactly once, to be submitted
+	// ahead of any overlay drawing
+	VkCommandBuffer takeUpload();
+
+	// Render pass and pipelines for a swapchain format, created on first use
+	const OverlayPipelines& getPipelines(VkFormat format);
+};
+
+/*
+	Mostly self-contained text overlay class
+*/
+class TextOverlay
+{
+private:
+	OverlayShared *shared;
+	const OverlayPipelines *pipelines;
+	vks::VulkanDevice *vulkanDevice;
+
+	VkFormat colorFormat;
+
+	// TextOverlay gets recreated when swpachain resizes so take these as values
+	uint32_t frameBufferWidth;
+	uint32_t frameBufferHeight;
+
+	/*
+		Triple buffered text: the writer (stats thread) fills textBuffers[writeIndex],
+		the present thread draws textBuffers[readIndex] and the third one is parked
+		in `published`. Both sides only ever swap their own index with the parked
+		one, so neither can block the other. TEXTOVERLAY_FRESH marks a parked
+		buffer the reader has not picked up yet.
+
+		A buffer the reader let go of may still be read by the GPU. The writer
+		checks TextBuffer::reads against imageDone and skips the update while
+		it is busy, unless it can take back a fresh buffer the reader never saw.
+	*/
+	TextBuffer textBuffers[TEXTOVERLAY_BUFFER_COUNT];
+	uint32_t writeIndex = 0, readIndex = 2;
+	std::atomic<uint32_t> published { 1 };
+	uint64_t writeGeneration = 0;
 	VkCommandPool commandPool;
 	std::vector<VkCommandBuffer> cmdBuffers;
 	std::vector<VkFramebuffer*> frameBuffers;
-	std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
+	// Dynamic rendering draws to the swapchain image views instead
+	std::vector<VkImageView> imageViews;
 
-	// Pointer to mapped vertex buffer
-	Vertex *mapped = nullptr;
-
-	stb_fontchar stbFontData[STB_FONT_consolas_bold_24_latin1_NUM_CHARS];
+	// Writer side cursor into textBuffers[writeIndex]
+	GlyphInstance *mapped = nullptr;
+	GlyphRecord *records = nullptr;
 	uint32_t numLetters;
-	glm::vec4 fontColor = {1.0f, 1.0f, 1.0f, 1.0f};
+	TextBounds bbox;
+
+	// Generation of the text buffer each command buffer was recorded with,
+	// they are only re-recorded when a newer buffer gets picked up
+	std::vector<uint64_t> cmdBufferGenerations;
+
+	// Vertex pulling, descriptor sets of the text buffers
+	VkDescriptorPool glyphPool = VK_NULL_HANDLE;
+
+	// Compute composite, the cache tile is blended into the swapchain image
+	// as a storage image without any render pass or framebuffer
+	bool compute = false;
+	VkDescriptorPool storagePool = VK_NULL_HANDLE;
+	std::vector<VkDescriptorSet> storageSets;
+
+	// Offscreen mode: text is drawn into `cache` only when it changes and
+	// every frame just blends one quad of it onto the swapchain image
+	CacheTarget cache;
+	VkRect2D cacheRect {};
+	VkDescriptorPool compositePool = VK_NULL_HANDLE;
+	VkCommandBuffer cacheCmdBuffer = VK_NULL_HANDLE;
+	uint64_t cacheGeneration = UINT64_MAX;
+	bool cachePending = false;
+	/*
+		Submit counters, to know when the GPU is done with the cache command
+		buffer or an outgrown cache image. Overlay work goes out on whatever
+		queue the application submits or presents on, so a lower serial may
+		finish after a higher one. Completion is only known per swapchain
+		image: the layer waits for an image's previous submit before drawing
+		it again, that serial is then imageDone[image].
+	*/
+	uint64_t submitSerial = 0;
+	std::vector<uint64_t> cmdBufferSerials;
+	std::vector<std::atomic<uint64_t>> imageDone;
+	// Image and serial the cache command buffer last went out with
+	uint32_t cacheImage = 0;
+	uint64_t cacheSerial = 0;
+	// Outgrown caches, with the last serial of every image that may still sample them
+	std::vector<std::pair<std::vector<uint64_t>, CacheTarget>> retiredCaches;
+	bool completed(const std::vector<uint64_t>& serials) const;
+	bool textBufferBusy(const TextBuffer& text) const;
+
+	void createCacheTarget(CacheTarget& target, uint32_t width, uint32_t height);
+	void destroyCacheTarget(CacheTarget& target);
+	VkRect2D pixelBounds(const TextBuffer& text) const;
+	void updateCache();
+	void drawText(VkCommandBuffer cmdBuffer, const TextBuffer& text);
+	void recordComputeComposite(uint32_t image_index, VkImageMemoryBarrier imb);
+
 public:
 
 	enum TextAlign { alignLeft, alignCenter, alignRight };
 
 	bool visible = true;
 
+	// With imageviews (one per swapchain image) the framebuffers are not used:
+	// the overlay is composited with compute into them as storage images, or
+	// drawn with dynamic rendering
 	TextOverlay(
-		vks::VulkanDevice *vulkanDevice,
-		VkQueue queue,
+		OverlayShared *shared,
 		std::vector<VkFramebuffer> &framebuffers,
 		VkFormat colorformat,
-//		VkFormat depthformat,
 		uint32_t framebufferwidth,
-		uint32_t framebufferheight
-		/*, std::vector<VkPipelineShaderStageCreateInfo> shaderstages*/);
+		uint32_t framebufferheight,
+		const std::vector<VkImageView> *imageviews = nullptr,
+		bool compute = false);
 
 	~TextOverlay();
 
-	VkPipelineShaderStageCreateInfo loadShader(const uint32_t *shaderCode, const size_t size, VkShaderStageFlagBits stage);
-	// Prepare all vulkan resources required to render the font
-	// The text overlay uses separate resources for descriptors (pool, sets, layouts), pipelines and command buffers
+	// Prepare the per swapchain resources: command buffers and text buffers
 	void prepareResources();
 
-	// Prepare a separate pipeline for the font rendering decoupled from the main application
-	void preparePipeline();
-
-	// Prepare a separate render pass for rendering the text as an overlay
-	void prepareRenderPass();
-
-	// Map buffer 
-	void beginTextUpdate();
+	// Start filling the writer's buffer. False if the GPU still reads every
+	// buffer the writer could use, skip this update then
+	bool beginTextUpdate();
 
-	// Add text to the current buffer
-	// todo : drop shadow? color attribute?
-	void addText(std::string text, float x, float y, float scale = 1.0f, TextAlign align = alignLeft);
+	// Add text to the current buffer, color is an index into the palette
+	// todo : drop shadow?
+	void addText(std::string text, float x, float y, float scale = 1.0f, TextAlign align = alignLeft, uint32_t color = 0);
 
-	// Unmap buffer and update command buffers
+	// Hand the buffer to the present thread, never blocks
 	void endTextUpdate();
 
 	// Needs to be called by the application
+	// Only records if the text changed since the last time this image's buffer was recorded
 	void updateCommandBuffers(uint32_t image_index, VkImageMemoryBarrier imb);
 
-	// Submit the text command buffers to a queue
-	// Does a queue wait idle
-	void submit(VkQueue queue, uint32_t bufferindex, VkSubmitInfo submit_info, VkFence fence);
+	// Append this frame's command buffers to a submit the caller makes,
+	// so several swapchains can share one QueueSubmit
+	void appendCommandBuffers(uint32_t bufferindex, std::vector<VkCommandBuffer>& cmds);
 };
@@ -1,11 +1,16 @@
 #version 450 core
 
-layout (location = 0) in vec2 inPos;
-layout (location = 1) in vec2 inUV;
-layout (location = 2) in vec3 inCol;
+// Per instance: one glyph
+layout (location = 0) in vec4 inPos;	// x0, y0, x1, y1, fetched from SNORM16
+layout (location = 1) in vec4 inUV;	// s0, t0, s1, t1, fetched from UNORM16
+layout (location = 2) in uint inColor;
+
+layout (binding = 1) uniform Palette {
+	vec4 colors[4];
+};
 
 layout (location = 0) out vec2 outUV;
-layout (location = 1) out vec3 outCol;
+layout (location = 1) out vec4 outCol;
 
 out gl_PerVertex
 {
@@ -14,7 +19,9 @@ out gl_PerVertex
 
 void main(void)
 {
-	gl_Position = vec4(inPos, 0.0, 1.0);
-	outUV = inUV;
-	outCol = inCol;
+	// Triangle strip corners: (0,0) (1,0) (0,1) (1,1)
+	vec2 corner = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1);
+	gl_Position = vec4(mix(inPos.xy, inPos.zw, corner), 0.0, 1.0);
+	outUV = mix(inUV.xy, inUV.zw, corner);
+	outCol = colors[inColor];
 }
@@ -0,0 +1,50 @@
+#version 450 core
+
+// Vertex pulling variant of overlay.vert (NUUDEL_VERTEX_PULLING):
+// one GlyphRecord per instance, quads are built from the font metrics
+
+struct Metric {
+	vec4 rect;	// x0, y0, x1, y1 in font pixels relative to the pen
+	vec4 uv;	// s0, t0, s1, t1
+};
+
+layout (binding = 1) uniform Palette {
+	vec4 colors[4];
+};
+
+layout (std430, binding = 2) readonly buffer Metrics {
+	Metric metrics[];
+};
+
+// GlyphRecord: x, y (int16, 1/4 px) | glyph (u8), color (u8), scale (u16, 8.8)
+layout (std430, set = 1, binding = 0) readonly buffer Glyphs {
+	uvec2 glyphs[];
+};
+
+layout (push_constant) uniform Framebuffer {
+	vec2 fbSize;
+};
+
+layout (location = 0) out vec2 outUV;
+layout (location = 1) out vec4 outCol;
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+void main(void)
+{
+	uvec2 g = glyphs[gl_InstanceIndex];
+	vec2 pen = vec2(int(g.x << 16) >> 16, int(g.x) >> 16) * 0.25;
+	Metric m = metrics[g.y & 0xFFu];
+	float scale = float(g.y >> 16) / 256.0;
+
+	// Triangle strip corners: (0,0) (1,0) (0,1) (1,1)
+	vec2 corner = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1);
+	// Same glyph size addText uses for the instanced path
+	vec2 pos = pen + mix(m.rect.xy, m.rect.zw, corner) * (0.75 * scale * scale);
+	gl_Position = vec4(pos / fbSize * 2.0 - 1.0, 0.0, 1.0);
+	outUV = mix(m.uv.xy, m.uv.zw, corner);
+	outCol = colors[(g.y >> 8) & 0xFFu];
+}
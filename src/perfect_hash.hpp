@@ -0,0 +1,81 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// FNV-1a, seeded so PerfectHash can search for a collision free variant
+constexpr uint32_t fnv1a(const char *str, uint32_t seed)
+{
+	uint32_t hash = 2166136261u ^ seed;
+	while (*str) {
+		hash ^= static_cast<uint8_t>(*str++);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+constexpr size_t next_pow2(size_t v)
+{
+	size_t p = 1;
+	while (p < v)
+		p <<= 1;
+	return p;
+}
+
+/*
+	Compile-time perfect hash over a fixed list of strings.
+
+	The constructor searches for a seed that maps every name to its own slot,
+	so a lookup is one hash, one table load and a single strcmp to reject
+	names that are not in the list. Use it through a constexpr variable so
+	the seed search happens at compile time.
+*/
+template<size_t N>
+class PerfectHash
+{
+public:
+	static constexpr size_t size = next_pow2(N * 4);
+
+	constexpr explicit PerfectHash(const char * const (&list)[N])
+	{
+		for (uint32_t s = 0;; s++) {
+			bool used[size] {};
+			bool ok = true;
+			for (size_t i = 0; i < N && ok; i++) {
+				size_t slot = fnv1a(list[i], s) & (size - 1);
+				ok = !used[slot];
+				used[slot] = true;
+			}
+			if (ok) {
+				seed = s;
+				break;
+			}
+		}
+
+		for (size_t i = 0; i < N; i++) {
+			size_t slot = fnv1a(list[i], seed) & (size - 1);
+			names[slot] = list[i];
+			index[slot] = static_cast<int>(i);
+		}
+	}
+
+	// Position of name in the original list, or -1
+	int lookup(const char *name) const
+	{
+		size_t slot = fnv1a(name, seed) & (size - 1);
+		if (names[slot] && !strcmp(names[slot], name))
+			return index[slot];
+		return -1;
+	}
+
+private:
+	uint32_t seed = 0;
+	const char *names[size] {};
+	int index[size] {};
+};
+
+template<size_t N>
+constexpr PerfectHash<N> make_perfect_hash(const char * const (&list)[N])
+{
+	return PerfectHash<N>(list);
+}
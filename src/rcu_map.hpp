@@ -0,0 +1,221 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+
+/*
+	Read-mostly hash map keyed by pointers (loader dispatch keys, Vulkan handles).
+
+	Lookups never take a lock: they probe an open addressing table through
+	atomics. Inserts and erases are serialized by an internal mutex and anything
+	they unlink (old tables after a resize, erased values) is only freed after a
+	grace period, once every reader that could still be probing it has left.
+
+	The grace period uses two reader counters indexed by the low bit of an epoch.
+	A reader bumps the counter of the current epoch and re-checks the epoch;
+	a writer flips the epoch and waits for the previous counter to drain.
+
+	Returned pointers stay valid until the entry is erased. Erasing an object
+	while another thread still uses it is an application error anyway per the
+	Vulkan external synchronization rules (e.g. destroying a swapchain that is
+	being presented), so the map does not try to protect against that.
+
+	Do not call insert/erase from inside a for_each callback on the same map,
+	the writer would wait on its own read guard.
+*/
+template<typename T>
+class RCUMap
+{
+	struct Slot {
+		std::atomic<void *> key { nullptr };
+		std::atomic<T *> value { nullptr };
+	};
+
+	struct Table {
+		explicit Table(size_t size) : mask(size - 1), slots(new Slot[size]) {}
+		~Table() { delete [] slots; }
+		const size_t mask;
+		Slot * const slots;
+	};
+
+	class ReadGuard {
+	public:
+		explicit ReadGuard(const RCUMap& map) : map(map)
+		{
+			for (;;) {
+				index = map.epoch.load() & 1;
+				map.readers[index].fetch_add(1);
+				if ((map.epoch.load() & 1) == index)
+					break;
+				// raced with a writer flipping the epoch, retry on the new one
+				map.readers[index].fetch_sub(1);
+			}
+		}
+		~ReadGuard() { map.readers[index].fetch_sub(1); }
+	private:
+		const RCUMap& map;
+		unsigned index;
+	};
+
+	static void *tombstone() { return reinterpret_cast<void *>(~uintptr_t(0)); }
+
+	static size_t hash(void *key)
+	{
+		uint64_t h = reinterpret_cast<uintptr_t>(key);
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		return static_cast<size_t>(h);
+	}
+
+	static T *probe(const Table *table, void *key)
+	{
+		for (size_t i = hash(key);; i++) {
+			const Slot& slot = table->slots[i & table->mask];
+			void *k = slot.key.load();
+			if (k == key)
+				return slot.value.load();
+			if (k == nullptr)
+				return nullptr;
+		}
+	}
+
+	// Wait until nobody can still be looking at what was unlinked before the call
+	void synchronize()
+	{
+		unsigned prev = epoch.fetch_add(1) & 1;
+		while (readers[prev].load() != 0)
+			std::this_thread::yield();
+	}
+
+	// Caller holds writer_lock
+	void grow()
+	{
+		Table *old = table.load();
+		size_t size = old->mask + 1;
+		if (live * 4 >= size)
+			size *= 2;
+
+		Table *fresh = new Table(size);
+		for (size_t i = 0; i <= old->mask; i++) {
+			void *k = old->slots[i].key.load();
+			if (k == nullptr || k == tombstone())
+				continue;
+			for (size_t j = hash(k);; j++) {
+				Slot& slot = fresh->slots[j & fresh->mask];
+				if (slot.key.load() == nullptr) {
+					slot.value.store(old->slots[i].value.load());
+					slot.key.store(k);
+					break;
+				}
+			}
+		}
+
+		table.store(fresh);
+		used = live;
+		synchronize();
+		delete old;
+	}
+
+public:
+	RCUMap() : table(new Table(16)) {}
+	RCUMap(const RCUMap&) = delete;
+	RCUMap& operator=(const RCUMap&) = delete;
+
+	~RCUMap()
+	{
+		Table *t = table.load();
+		for (size_t i = 0; i <= t->mask; i++)
+			delete t->slots[i].value.load();
+		delete t;
+	}
+
+	// Lock-free lookup, nullptr if key is not in the map
+	T *find(void *key) const
+	{
+		ReadGuard guard(*this);
+		return probe(table.load(), key);
+	}
+
+	// Lookup, default constructing the value if missing (like std::map)
+	T& operator[](void *key)
+	{
+		if (T *value = find(key))
+			return *value;
+
+		std::lock_guard<std::mutex> l(writer_lock);
+		if (T *value = probe(table.load(), key))
+			return *value;
+
+		Table *t = table.load();
+		if ((used + 1) * 2 > t->mask + 1) {
+			grow();
+			t = table.load();
+		}
+
+		T *value = new T();
+		for (size_t i = hash(key);; i++) {
+			Slot& slot = t->slots[i & t->mask];
+			void *k = slot.key.load();
+			if (k == nullptr || k == tombstone()) {
+				if (k == nullptr)
+					used++;
+				// publish value before the key so readers never see a half entry
+				slot.value.store(value);
+				slot.key.store(key);
+				break;
+			}
+		}
+		live++;
+		return *value;
+	}
+
+	void erase(void *key)
+	{
+		T *value = nullptr;
+		{
+			std::lock_guard<std::mutex> l(writer_lock);
+			Table *t = table.load();
+			for (size_t i = hash(key);; i++) {
+				Slot& slot = t->slots[i & t->mask];
+				void *k = slot.key.load();
+				if (k == nullptr)
+					return;
+				if (k == key) {
+					value = slot.value.exchange(nullptr);
+					slot.key.store(tombstone());
+					live--;
+					break;
+				}
+			}
+			synchronize();
+		}
+		delete value;
+	}
+
+	// Visit every entry, func(void *key, T& value). Runs under a read guard,
+	// so erasing an entry waits until the walk is done with it.
+	template<typename F>
+	void for_each(F func) const
+	{
+		ReadGuard guard(*this);
+		const Table *t = table.load();
+		for (size_t i = 0; i <= t->mask; i++) {
+			void *k = t->slots[i].key.load();
+			if (k == nullptr || k == tombstone())
+				continue;
+			if (T *value = t->slots[i].value.load())
+				func(k, *value);
+		}
+	}
+
+private:
+	std::atomic<Table *> table;
+	mutable std::atomic<unsigned> epoch { 0 };
+	mutable std::atomic<unsigned> readers[2] {};
+	std::mutex writer_lock;
+	size_t used = 0; // live + tombstones, guarded by writer_lock
+	size_t live = 0;
+};
@@ -4,6 +4,8 @@
 #include <fstream>
 #include <sstream>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
 #include <algorithm>
 
@@ -15,6 +17,9 @@
 #define PROCSTATFILE PROCDIR "/stat"
 #endif
 
+// "cpuN" and ten 64 bit counters with their separators fit with room to spare
+#define PROCSTAT_CPU_LINE_MAX 256
+
 #ifndef PROCMEMINFOFILE
 #define PROCMEMINFOFILE PROCDIR "/meminfo"
 #endif
@@ -93,26 +98,36 @@ void calculateCPUData(CPUData& cpuData,
 }
 
 
-CPUStats::CPUStats()
+CPUStats::CPUStats() : CPUStats(PROCSTATFILE)
+{
+}
+
+CPUStats::CPUStats(const std::string& path) : m_path(path)
 {
 	m_inited = Init();
 }
 
+CPUStats::~CPUStats()
+{
+	if (m_fd > -1)
+		close(m_fd);
+}
+
 bool CPUStats::Init()
 {
 	std::string line;
-	std::ifstream file (PROCSTATFILE);
+	std::ifstream file (m_path);
 	bool first = true;
 	m_cpuData.clear();
 
 	if (!file.is_open()) {
-		std::cerr << "Failed to opening " << PROCSTATFILE << std::endl;
+		std::cerr << "Failed to opening " << m_path << std::endl;
 		return false;
 	}
 
 	do {
 		if (!std::getline(file, line)) {
-			std::cerr << "Failed to read all of " << PROCSTATFILE << std::endl;
+			std::cerr << "Failed to read all of " << m_path << std::endl;
 			return false;
 		} else if (starts_with(line, "cpu")) {
 			if (first) {
@@ -139,60 +154,103 @@ bool CPUStats::Init()
 		}
 	} while(true);
 
+	if (m_cpuData.empty())
+		return false;
+
+	if (m_fd > -1)
+		close(m_fd);
+	m_fd = open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (m_fd < 0) {
+		perror(m_path.c_str());
+		return false;
+	}
+	// Room for every cpu line, the rest of the file is never needed
+	m_buffer.resize((m_cpuData.size() + 1) * PROCSTAT_CPU_LINE_MAX);
+
+	m_inited = true;
 	UpdateCPUData();
 	return true;
 }
 
-//TODO take sampling interval into account?
-bool CPUStats::UpdateCPUData()
+// Skips the spaces in front and reads one unsigned decimal, nullptr if there is none
+static const char *scan_ull(const char *p, const char *end, unsigned long long& value)
 {
-	unsigned long long int usertime, nicetime, systemtime, idletime;
-	unsigned long long int ioWait, irq, softIrq, steal, guest, guestnice;
-	int cpuid = -1;
-
-	if (!m_inited)
-		return false;
+	while (p < end && *p == ' ')
+		p++;
+	if (p == end || *p < '0' || *p > '9')
+		return nullptr;
+
+	value = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+		value = value * 10 + (*p++ - '0');
+	return p;
+}
 
-	std::string line;
-	std::ifstream file (PROCSTATFILE);
+// The "cpu" line followed by one "cpuN" line per core, whatever comes after them ends the walk
+bool CPUStats::ParseCPULines(const char *p, const char *end)
+{
+	// user nice system idle iowait irq softirq steal guest guest_nice
+	unsigned long long v[10];
 	bool ret = false;
 
-	if (!file.is_open()) {
-		std::cerr << "Failed to opening " << PROCSTATFILE << std::endl;
-		return false;
-	}
+	while (end - p > 3 && !memcmp(p, "cpu", 3)) {
+		const char *line = p;
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		// Cut off by the end of the buffer
+		if (!eol)
+			break;
 
-	do {
-		if (!std::getline(file, line)) {
+		p += 3;
+		bool total = *p == ' ';
+		unsigned long long cpuid = 0;
+		if (!total && !(p = scan_ull(p, eol, cpuid)))
 			break;
-		} else if (!ret && sscanf(line.c_str(), "cpu  %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu",
-			&usertime, &nicetime, &systemtime, &idletime, &ioWait, &irq, &softIrq, &steal, &guest, &guestnice) == 10) {
-			ret = true;
-			calculateCPUData(m_cpuDataTotal, usertime, nicetime, systemtime, idletime, ioWait, irq, softIrq, steal, guest, guestnice);
-		} else if (sscanf(line.c_str(), "cpu%4d %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu",
-			&cpuid, &usertime, &nicetime, &systemtime, &idletime, &ioWait, &irq, &softIrq, &steal, &guest, &guestnice) == 11) {
 
-			//std::cerr << "Parsing 'cpu" << cpuid << "' line:" <<  line << std::endl;
+		int n = 0;
+		for (const char *next; n < 10 && (next = scan_ull(p, eol, v[n])); n++)
+			p = next;
+
+		if (total) {
+			if (ret || n < 10)
+				break;
+			ret = true;
+			calculateCPUData(m_cpuDataTotal, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9]);
+		} else {
+			if (n < 10)
+				break;
 
 			if (!ret) {
-				//std::cerr << "Failed to parse 'cpu' line" << std::endl;
-				std::cerr << "Failed to parse 'cpu' line:" <<  line << std::endl;
+				std::cerr << "Failed to parse 'cpu' line:" << std::string(line, eol) << std::endl;
 				return false;
 			}
 
-			if (cpuid < 0 /* can it? */ || (size_t)cpuid > m_cpuData.size()) {
+			if (cpuid >= m_cpuData.size()) {
 				std::cerr << "Cpu id '" << cpuid << "' is out of bounds" << std::endl;
 				return false;
 			}
 
-			CPUData& cpuData = m_cpuData[cpuid];
-			calculateCPUData(cpuData, usertime, nicetime, systemtime, idletime, ioWait, irq, softIrq, steal, guest, guestnice);
-			cpuid = -1;
-
-		} else {
-			break;
+			calculateCPUData(m_cpuData[cpuid], v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9]);
 		}
-	} while(true);
+		p = eol + 1;
+	}
+
+	return ret;
+}
+
+//TODO take sampling interval into account?
+bool CPUStats::UpdateCPUData()
+{
+	if (!m_inited)
+		return false;
+
+	// /proc regenerates the file for every read from offset 0, no need to reopen or seek
+	ssize_t len = pread(m_fd, m_buffer.data(), m_buffer.size(), 0);
+	if (len < 0) {
+		perror(m_path.c_str());
+		return false;
+	}
+
+	bool ret = ParseCPULines(m_buffer.data(), m_buffer.data() + len);
 
 	m_cpuPeriod = (double)m_cpuData[0].totalPeriod / m_cpuData.size();
 	m_updatedCPUs = true;
@@ -1,4 +1,5 @@
 //extern long long btime;
+#include <string>
 #include <vector>
 #include <cstdint>
 
@@ -74,6 +75,11 @@ class CPUStats
 {
 public:
 	CPUStats();
+	// A /proc/stat lookalike instead, for tests
+	explicit CPUStats(const std::string& path);
+	~CPUStats();
+	CPUStats(const CPUStats&) = delete;
+	CPUStats& operator=(const CPUStats&) = delete;
 	bool Init();
 	bool Updated()
 	{
@@ -96,4 +102,10 @@ private:
 	double m_cpuPeriod = 0;
 	bool m_updatedCPUs = false; // TODO use caching or just update?
 	bool m_inited = false;
+
+	// m_path (PROCSTATFILE) stays open, every update is one pread into m_buffer
+	std::string m_path;
+	int m_fd = -1;
+	std::vector<char> m_buffer;
+	bool ParseCPULines(const char *p, const char *end);
 };
@@ -0,0 +1,85 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+
+// One glyph placed by TextPen, in NDC
+struct GlyphQuad
+{
+	float penX, penY;        // pen position the glyph was placed at
+	float x0, y0, x1, y1;    // quad corners
+};
+
+/* The pen TextOverlay::addText lays text out with. Starts at a position in
+ * framebuffer pixels, works in NDC and moves by the font's glyph metrics.
+ */
+struct TextPen
+{
+	float x, y;
+	float charW, charH;  // NDC per font pixel
+	float scale;
+
+	TextPen(float px, float py, float scale, uint32_t width, uint32_t height)
+		: x(px / width * 2.0f - 1.0f), y(py / height * 2.0f - 1.0f),
+		charW(1.5f * scale / width), charH(1.5f * scale / height), scale(scale)
+	{
+	}
+
+	// Place `glyph` (an stb_fontchar) at the pen and move the pen past it
+	template<typename Glyph>
+	GlyphQuad place(const Glyph& glyph)
+	{
+		GlyphQuad quad = { x, y,
+			x + (float)glyph.x0 * charW * scale, y + (float)glyph.y0 * charH * scale,
+			x + (float)glyph.x1 * charW * scale, y + (float)glyph.y1 * charH * scale };
+		x += glyph.advance * charW * scale;
+		return quad;
+	}
+};
+
+// Union of a text's glyph quads in NDC, inverted until one is added
+struct TextBounds
+{
+	float x0 = FLT_MAX, y0 = FLT_MAX;
+	float x1 = -FLT_MAX, y1 = -FLT_MAX;
+
+	void add(const GlyphQuad& quad)
+	{
+		x0 = std::min(x0, quad.x0);
+		y0 = std::min(y0, quad.y0);
+		x1 = std::max(x1, quad.x1);
+		y1 = std::max(y1, quad.y1);
+	}
+};
+
+// A framebuffer region in pixels, zero sized when there is nothing in it
+struct PixelRect
+{
+	int32_t x = 0, y = 0;
+	uint32_t width = 0, height = 0;
+};
+
+// Text bounds in framebuffer pixels, with a pixel of slack for filtering and
+// clipped to the framebuffer
+static inline PixelRect textPixelBounds(const TextBounds& bounds, uint32_t width, uint32_t height)
+{
+	// Nothing added or all of it off screen
+	if (bounds.x1 < bounds.x0 || bounds.y1 < bounds.y0 || bounds.x0 >= 1.0f || bounds.y0 >= 1.0f
+		|| bounds.x1 <= -1.0f || bounds.y1 <= -1.0f)
+		return {};
+
+	float x0f = std::max(bounds.x0, -1.0f);
+	float y0f = std::max(bounds.y0, -1.0f);
+	float x1f = std::min(bounds.x1, 1.0f);
+	float y1f = std::min(bounds.y1, 1.0f);
+
+	int32_t x0 = std::max(0, (int32_t)floorf((x0f + 1.0f) * 0.5f * width) - 1);
+	int32_t y0 = std::max(0, (int32_t)floorf((y0f + 1.0f) * 0.5f * height) - 1);
+	int32_t x1 = std::min((int32_t)width, (int32_t)ceilf((x1f + 1.0f) * 0.5f * width) + 1);
+	int32_t y1 = std::min((int32_t)height, (int32_t)ceilf((y1f + 1.0f) * 0.5f * height) + 1);
+	if (x1 <= x0 || y1 <= y0)
+		return {};
+
+	return { x0, y0, (uint32_t)(x1 - x0), (uint32_t)(y1 - y0) };
+}
@@ -367,7 +367,7 @@ namespace vks
 			}
 		}
 
-		VkShaderModule loadShader(const uint32_t *shaderCode, const size_t size, VkDevice device)
+		VkShaderModule loadShader(const uint32_t *shaderCode, const size_t size, VkDevice device, const VkAllocationCallbacks *allocator)
 		{
 			assert(size > 0);
 
@@ -377,7 +377,7 @@ namespace vks
 			moduleCreateInfo.codeSize = size;
 			moduleCreateInfo.pCode = shaderCode;
 
-			VK_CHECK_RESULT(g_device_dispatch[GetKey(device)].vtable.CreateShaderModule(device, &moduleCreateInfo, NULL, &shaderModule));
+			VK_CHECK_RESULT(g_device_dispatch[GetKey(device)].vtable.CreateShaderModule(device, &moduleCreateInfo, allocator, &shaderModule));
 
 			return shaderModule;
 		}
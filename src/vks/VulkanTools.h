@@ -125,7 +125,7 @@ namespace vks
 		VkShaderModule loadShader(AAssetManager* assetManager, const char *fileName, VkDevice device);
 #else
 		VkShaderModule loadShader(const char *fileName, VkDevice device);
-		VkShaderModule loadShader(const uint32_t *shaderCode, const size_t size, VkDevice device);
+		VkShaderModule loadShader(const uint32_t *shaderCode, const size_t size, VkDevice device, const VkAllocationCallbacks *allocator = nullptr);
 #endif
 
 		// Load a GLSL shader (text)
@@ -0,0 +1,109 @@
+// Checks that every entry point the layer intercepts is a vk.xml command and
+// round-trips through the compile-time perfect hash, and that every other
+// vk.xml command misses.
+//
+// Usage: proc_lookup [--bench]
+//   --bench  also time the lookups against the strcmp chain they replaced
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "layer_procs.hpp"
+#include "perfect_hash.hpp"
+
+#define PROC_NAME(func) "vk" #func,
+
+static constexpr const char *device_proc_names[] = { DEVICE_CHAIN_PROCS(PROC_NAME) DEVICE_PROCS(PROC_NAME) };
+static constexpr auto device_proc_hash = make_perfect_hash(device_proc_names);
+
+static constexpr const char *instance_proc_names[] = { INSTANCE_PROCS(PROC_NAME) DEVICE_CHAIN_PROCS(PROC_NAME) };
+static constexpr auto instance_proc_hash = make_perfect_hash(instance_proc_names);
+
+#undef PROC_NAME
+
+// Every command in vk.xml, core and extensions, generated by vk_commands.py.
+// What a loader or application may ask the layer for.
+#include "vk_commands.h"
+
+// What GetDeviceProcAddr did before the hash
+static int strcmp_chain(const char *name)
+{
+	for (size_t i = 0; i < sizeof(device_proc_names) / sizeof(device_proc_names[0]); i++)
+		if (!strcmp(device_proc_names[i], name))
+			return (int)i;
+	return -1;
+}
+
+template<size_t N, typename Hash>
+static int check(const char *what, const char * const (&names)[N], const Hash& hash)
+{
+	int failures = 0;
+
+	for (size_t i = 0; i < N; i++) {
+		int index = hash.lookup(names[i]);
+		if (index != (int)i) {
+			fprintf(stderr, "%s: %s resolved to %d, expected %zu\n", what, names[i], index, i);
+			failures++;
+		}
+
+		// A typo in layer_procs.hpp would intercept nothing
+		bool known = false;
+		for (const char *command : vk_commands)
+			known |= !strcmp(names[i], command);
+		if (!known) {
+			fprintf(stderr, "%s: %s is not a vk.xml command\n", what, names[i]);
+			failures++;
+		}
+	}
+
+	for (const char *command : vk_commands) {
+		bool intercepted = false;
+		for (const char *name : names)
+			intercepted |= !strcmp(name, command);
+		if (!intercepted && hash.lookup(command) != -1) {
+			fprintf(stderr, "%s: %s is not intercepted but resolved to %d\n", what, command, hash.lookup(command));
+			failures++;
+		}
+	}
+
+	// Near misses have to fail the strcmp, not just land on an empty slot
+	static const char * const absent[] = { "", "vk", "vkQueueSubmit3", "vkqueuesubmit", "QueueSubmit", "vkQueuePresentKHRX" };
+	for (const char *name : absent) {
+		if (hash.lookup(name) != -1) {
+			fprintf(stderr, "%s: \"%s\" should miss\n", what, name);
+			failures++;
+		}
+	}
+
+	return failures;
+}
+
+template<typename F>
+static double time_lookups(F lookup)
+{
+	const int rounds = 20000;
+	volatile int sink = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++)
+		for (const char *command : vk_commands)
+			sink = sink + lookup(command);
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+	return elapsed.count() / (rounds * (sizeof(vk_commands) / sizeof(vk_commands[0])));
+}
+
+int main(int argc, char **argv)
+{
+	int failures = check("device", device_proc_names, device_proc_hash)
+		+ check("instance", instance_proc_names, instance_proc_hash);
+	if (failures)
+		return 1;
+
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		printf("%zu vk.xml commands\n", sizeof(vk_commands) / sizeof(vk_commands[0]));
+		printf("perfect hash: %6.1f ns/lookup\n", time_lookups([](const char *name) { return device_proc_hash.lookup(name); }));
+		printf("strcmp chain: %6.1f ns/lookup\n", time_lookups(strcmp_chain));
+	}
+	return 0;
+}
@@ -0,0 +1,218 @@
+// Feeds CPUStats /proc/stat fixtures: checks the per core percentages after
+// two ticks, a read cut off in the middle of the cpu lines and cpu ids
+// past the ones Init counted.
+//
+// Usage: proc_stat [--bench] [recorded /proc/stat...]
+//   --bench  also time an update against the getline + sscanf parser it
+//            replaced, on a generated 192 core fixture and on any files given
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "stats.hpp"
+
+// stats.cpp, not in the header
+void calculateCPUData(CPUData& cpuData,
+	unsigned long long int usertime,
+	unsigned long long int nicetime,
+	unsigned long long int systemtime,
+	unsigned long long int idletime,
+	unsigned long long int ioWait,
+	unsigned long long int irq,
+	unsigned long long int softIrq,
+	unsigned long long int steal,
+	unsigned long long int guest,
+	unsigned long long int guestnice);
+
+// Busy ticks out of 1000 for core `cpu`, between two fixture ticks
+static unsigned busy(unsigned cpu)
+{
+	return cpu * 37 % 1000;
+}
+
+// /proc/stat of a machine with `cpus` cores after `tick` sampling periods.
+// Counters start in the millions like on a machine that has been up a while
+static std::string procStat(unsigned cpus, unsigned tick)
+{
+	std::vector<unsigned long long> total(10);
+	std::string lines;
+	char line[256];
+
+	for (unsigned i = 0; i < cpus; i++) {
+		unsigned b = busy(i);
+		unsigned long long v[10] = {
+			5000000ull + i * 1311 + tick * (b * 3 / 4),      // user
+			20000ull + i,                                    // nice
+			900000ull + i * 97 + tick * (b - b * 3 / 4),     // system
+			70000000ull + i * 7 + tick * (1000 - b),         // idle
+			4000ull + i, 0, 1000ull + i, 0, 0, 0,
+		};
+		snprintf(line, sizeof(line), "cpu%u %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n",
+			i, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9]);
+		lines += line;
+		for (int j = 0; j < 10; j++)
+			total[j] += v[j];
+	}
+
+	snprintf(line, sizeof(line), "cpu  %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n",
+		total[0], total[1], total[2], total[3], total[4], total[5], total[6], total[7], total[8], total[9]);
+	return line + lines
+		+ "intr 297305 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 1 1 2 0 0 0 0 718 16\n"
+		+ "ctxt 801198\nbtime 1792189148\nprocesses 28173\nprocs_running 2\nprocs_blocked 0\n"
+		+ "softirq 132590 0 61752 1 6531 0 0 1 0 21 64284\n";
+}
+
+// Rewritten in place, CPUStats keeps reading the same open file
+static void writeFile(const std::string& path, const std::string& contents)
+{
+	std::ofstream file(path, std::ios::trunc);
+	file << contents;
+}
+
+static int failures = 0;
+
+static void expect(bool ok, const char *what)
+{
+	if (!ok) {
+		fprintf(stderr, "%s\n", what);
+		failures++;
+	}
+}
+
+static void check(const std::string& path)
+{
+	const unsigned cpus = 192;
+	writeFile(path, procStat(cpus, 1));
+	CPUStats stats(path);
+	expect(stats.GetCPUData().size() == cpus, "Init did not count every cpu line");
+	if (stats.GetCPUData().size() != cpus)
+		return;
+
+	// One full period
+	writeFile(path, procStat(cpus, 2));
+	expect(stats.UpdateCPUData(), "update failed");
+	unsigned long long sum = 0;
+	for (unsigned i = 0; i < cpus; i++) {
+		const CPUData& cpu = stats.GetCPUData()[i];
+		sum += busy(i);
+		if (cpu.totalPeriod != 1000 || fabsf(cpu.percent - busy(i) / 10.0f) > 0.01f) {
+			fprintf(stderr, "cpu%u: %.2f%% over %llu, expected %.1f%% over 1000\n", i, cpu.percent, cpu.totalPeriod, busy(i) / 10.0f);
+			failures++;
+		}
+	}
+	expect(fabsf(stats.GetCPUDataTotal().percent - sum / (cpus * 10.0f)) < 0.01f, "wrong total percentage");
+
+	// Cut off in the middle of cpu100's line, the cores before it still update
+	// and the rest keep what the last tick gave them
+	std::string next = procStat(cpus, 3);
+	size_t cut = next.find("cpu100 ") + 20;
+	writeFile(path, next.substr(0, cut));
+	std::vector<CPUData> before = stats.GetCPUData();
+	expect(stats.UpdateCPUData(), "a truncated read after the total line failed");
+	for (unsigned i = 0; i < cpus; i++) {
+		bool updated = stats.GetCPUData()[i].totalTime != before[i].totalTime;
+		if (updated != (i < 100)) {
+			fprintf(stderr, "truncated read: cpu%u %s\n", i, updated ? "updated" : "not updated");
+			failures++;
+		}
+	}
+
+	// Not even the total line is complete
+	writeFile(path, next.substr(0, 30));
+	expect(!stats.UpdateCPUData(), "a read cut off in the total line succeeded");
+
+	// A core that was not there when Init counted them, the last valid id is cpus - 1
+	writeFile(path, procStat(cpus + 1, 4));
+	expect(!stats.UpdateCPUData(), "cpu id past the counted cores was accepted");
+	writeFile(path, procStat(cpus, 4));
+	expect(stats.UpdateCPUData(), "update after the out of bounds one failed");
+}
+
+// The getline + sscanf loop UpdateCPUData used to be
+static bool sscanfUpdate(const std::string& path, std::vector<CPUData>& cpuData, CPUData& cpuDataTotal)
+{
+	unsigned long long int usertime, nicetime, systemtime, idletime;
+	unsigned long long int ioWait, irq, softIrq, steal, guest, guestnice;
+	int cpuid = -1;
+	std::string line;
+	std::ifstream file(path);
+	bool ret = false;
+
+	while (std::getline(file, line)) {
+		if (!ret && sscanf(line.c_str(), "cpu  %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu",
+			&usertime, &nicetime, &systemtime, &idletime, &ioWait, &irq, &softIrq, &steal, &guest, &guestnice) == 10) {
+			ret = true;
+			calculateCPUData(cpuDataTotal, usertime, nicetime, systemtime, idletime, ioWait, irq, softIrq, steal, guest, guestnice);
+		} else if (sscanf(line.c_str(), "cpu%4d %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu %16llu",
+			&cpuid, &usertime, &nicetime, &systemtime, &idletime, &ioWait, &irq, &softIrq, &steal, &guest, &guestnice) == 11) {
+			if (!ret || cpuid < 0 || (size_t)cpuid >= cpuData.size())
+				return false;
+			calculateCPUData(cpuData[cpuid], usertime, nicetime, systemtime, idletime, ioWait, irq, softIrq, steal, guest, guestnice);
+		} else {
+			break;
+		}
+	}
+	return ret;
+}
+
+template<typename F>
+static double timeUpdates(F update)
+{
+	const int rounds = 2000;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++)
+		update();
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+	return elapsed.count() / rounds;
+}
+
+static void bench(const char *name, const std::string& path)
+{
+	CPUStats stats(path);
+	size_t cpus = stats.GetCPUData().size();
+	if (!cpus) {
+		fprintf(stderr, "%s: no cpu lines\n", name);
+		failures++;
+		return;
+	}
+
+	std::vector<CPUData> cpuData(cpus);
+	CPUData cpuDataTotal {};
+	double parser = timeUpdates([&] { stats.UpdateCPUData(); });
+	double baseline = timeUpdates([&] { sscanfUpdate(path, cpuData, cpuDataTotal); });
+
+	printf("%s, %zu cores\n", name, cpus);
+	printf("  pread + scan_ull: %9.0f ns/update %6.1f ns/core\n", parser, parser / (cpus + 1));
+	printf("  getline + sscanf: %9.0f ns/update %6.1f ns/core\n", baseline, baseline / (cpus + 1));
+}
+
+int main(int argc, char **argv)
+{
+	char path[] = "/tmp/proc_stat_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	check(path);
+
+	if (!failures && argc > 1 && !strcmp(argv[1], "--bench")) {
+		writeFile(path, procStat(192, 1));
+		bench("generated", path);
+		for (int i = 2; i < argc; i++)
+			bench(argv[i], argv[i]);
+	}
+
+	unlink(path);
+	return failures ? 1 : 0;
+}
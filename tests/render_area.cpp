@@ -0,0 +1,135 @@
+// Checks the overlay's render area against the glyphs that are drawn into it
+// and prints how many framebuffer bytes a frame touches with the full screen
+// render area it replaced, for a few typical overlays.
+//
+// Usage: render_area
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "font_atlas.h"
+#include "text_bounds.hpp"
+
+// Left aligned text through the same TextPen as TextOverlay::addText, x and y
+// in framebuffer pixels. Latin1, addText also decodes UTF-8 into it first.
+// Grows `bbox` and appends each glyph's quad to `glyphs`
+static void layoutText(const std::string& text, float x, float y, uint32_t width, uint32_t height,
+	TextBounds& bbox, std::vector<GlyphQuad>& glyphs)
+{
+	TextPen pen(x, y, 1.0f, width, height);
+	for (char letter : text) {
+		GlyphQuad quad = pen.place(font_atlas_chars[(uint8_t)letter - font_atlas_first_char]);
+		glyphs.push_back(quad);
+		bbox.add(quad);
+	}
+}
+
+// Lines stacked like updateTextOverlay does, 20 pixels apart
+static TextBounds layoutLines(const std::vector<std::string>& lines, float x, float y, uint32_t width, uint32_t height,
+	std::vector<GlyphQuad>& glyphs)
+{
+	TextBounds bbox;
+	for (auto& line : lines) {
+		layoutText(line, x, y, width, height, bbox, glyphs);
+		y += 20.0f;
+	}
+	return bbox;
+}
+
+static int failures = 0;
+
+static void expect(bool ok, const char *what, const char *name, uint32_t width, uint32_t height)
+{
+	if (!ok) {
+		fprintf(stderr, "%s %ux%u: %s\n", name, width, height, what);
+		failures++;
+	}
+}
+
+// The rect stays in the framebuffer and covers every pixel a glyph quad touches
+static void check(const char *name, const std::vector<std::string>& lines, float x, float y, uint32_t width, uint32_t height)
+{
+	std::vector<GlyphQuad> glyphs;
+	PixelRect rect = textPixelBounds(layoutLines(lines, x, y, width, height, glyphs), width, height);
+
+	expect(rect.x >= 0 && rect.y >= 0, "rect starts outside the framebuffer", name, width, height);
+	expect(rect.x + rect.width <= width && rect.y + rect.height <= height, "rect ends outside the framebuffer", name, width, height);
+
+	for (auto& glyph : glyphs) {
+		int32_t gx0 = std::max(0, (int32_t)floorf((glyph.x0 + 1.0f) * 0.5f * width));
+		int32_t gy0 = std::max(0, (int32_t)floorf((glyph.y0 + 1.0f) * 0.5f * height));
+		int32_t gx1 = std::min((int32_t)width, (int32_t)ceilf((glyph.x1 + 1.0f) * 0.5f * width));
+		int32_t gy1 = std::min((int32_t)height, (int32_t)ceilf((glyph.y1 + 1.0f) * 0.5f * height));
+		if (gx1 <= gx0 || gy1 <= gy0)
+			continue;
+		if (gx0 < rect.x || gy0 < rect.y || gx1 > rect.x + (int32_t)rect.width || gy1 > rect.y + (int32_t)rect.height) {
+			expect(false, "glyph outside the rect", name, width, height);
+			return;
+		}
+	}
+}
+
+static void checkEdgeCases()
+{
+	// Nothing was added, the bbox is still inverted
+	PixelRect rect = textPixelBounds(TextBounds(), 1920, 1080);
+	expect(rect.width == 0 && rect.height == 0, "empty text gets a rect", "empty", 1920, 1080);
+
+	// Entirely past the right and bottom edges, and past the left one
+	std::vector<GlyphQuad> glyphs;
+	rect = textPixelBounds(layoutLines({ "FPS: 144" }, 2000.0f, 1200.0f, 1920, 1080, glyphs), 1920, 1080);
+	expect(rect.width == 0 && rect.height == 0, "off screen text gets a rect", "off screen", 1920, 1080);
+	rect = textPixelBounds(layoutLines({ "FPS: 144" }, -500.0f, 25.0f, 1920, 1080, glyphs), 1920, 1080);
+	expect(rect.width == 0 && rect.height == 0, "off screen text gets a rect", "off screen left", 1920, 1080);
+
+	// Runs off the right edge, clipped instead of wrapping around
+	rect = textPixelBounds(layoutLines({ "FPS: 144" }, 1900.0f, 25.0f, 1920, 1080, glyphs), 1920, 1080);
+	expect(rect.width > 0 && rect.x + rect.width == 1920, "text over the edge is not clipped", "clipped", 1920, 1080);
+}
+
+int main()
+{
+	// The status lines updateTextOverlay writes, ° is a single latin1 glyph
+	std::vector<std::string> fps = { "FPS: 144" };
+	std::vector<std::string> stats = { "2026-10-16 21:04:33", "FPS: 144", "Core: 1905 MHz 67\xb0""C 1450 RPM ",
+		"Mem:  875 MHz 58\xb0""C ", "Busy: 97% ", "CPU:  23%" };
+	std::vector<std::string> cpus(stats.begin(), stats.end() - 1);
+	for (int i = 0; i < 16; i++)
+		cpus.push_back("CPU" + std::to_string(i) + ": " + std::to_string(i * 6) + "%");
+
+	const struct {
+		const char *name;
+		const std::vector<std::string>& lines;
+	} overlays[] = {
+		{ "fps", fps },
+		{ "default", stats },
+		{ "16 cpus", cpus },
+	};
+
+	const struct { uint32_t width, height; } framebuffers[] = {
+		{ 1280, 720 }, { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 },
+	};
+
+	checkEdgeCases();
+
+	// Load and store of the RGBA8 swapchain image, per frame
+	printf("%-8s %10s %12s %12s %7s\n", "overlay", "size", "full screen", "text bounds", "ratio");
+	for (auto& overlay : overlays) {
+		for (auto& fb : framebuffers) {
+			check(overlay.name, overlay.lines, 25.0f, 25.0f, fb.width, fb.height);
+
+			std::vector<GlyphQuad> glyphs;
+			PixelRect rect = textPixelBounds(layoutLines(overlay.lines, 25.0f, 25.0f, fb.width, fb.height, glyphs), fb.width, fb.height);
+			uint64_t before = (uint64_t)fb.width * fb.height * 4 * 2;
+			uint64_t after = (uint64_t)rect.width * rect.height * 4 * 2;
+			expect(after < before, "text bounds are not smaller than the screen", overlay.name, fb.width, fb.height);
+
+			printf("%-8s %5ux%-4u %12llu %12llu %6.1f%%\n", overlay.name, fb.width, fb.height,
+				(unsigned long long)before, (unsigned long long)after, 100.0 * after / before);
+		}
+	}
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+#!/usr/bin/env python3
+# Writes every command vk.xml defines, aliases included, as a C string array
+# for proc_lookup.
+#
+# Usage: vk_commands.py vk.xml vk_commands.h
+
+import sys
+import xml.etree.ElementTree as ET
+
+def commands(registry):
+    names = []
+    for command in registry.getroot().findall('commands/command'):
+        # Aliases are <command name="vkFooKHR" alias="vkFoo"/>, the rest has a <proto>
+        name = command.get('name') or command.findtext('proto/name')
+        if name and name not in names:
+            names.append(name)
+    return names
+
+def main():
+    names = commands(ET.parse(sys.argv[1]))
+    if not names:
+        sys.exit('no commands in ' + sys.argv[1])
+
+    with open(sys.argv[2], 'w') as out:
+        out.write('// Generated by vk_commands.py from vk.xml, do not edit\n')
+        out.write('static const char * const vk_commands[] = {\n')
+        for name in names:
+            out.write('\t"%s",\n' % name)
+        out.write('};\n')
+
+if __name__ == '__main__':
+    main()